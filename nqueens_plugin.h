@@ -0,0 +1,51 @@
+/*
+ * C ABI for solution plugins loaded with --plugin=path.so.
+ *
+ * The solver calls create() once for every worker that runs search tasks
+ * and hands that instance blocks of solutions. Instances never see two
+ * threads at once. When the search is done, they are merged into one,
+ * which gets finish() before every instance is destroyed.
+ *
+ * Build: cc -O2 -shared -fPIC -I<solver dir> plugin.c -o plugin.so
+ */
+#ifndef NQUEENS_PLUGIN_H
+#define NQUEENS_PLUGIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NQUEENS_PLUGIN_ABI_VERSION 1
+
+typedef struct nqueens_plugin_api
+{
+    /* Must be NQUEENS_PLUGIN_ABI_VERSION */
+    uint32_t abi_version;
+
+    /* New per-worker state; args is the --plugin-args string, or "" */
+    void *(*create)(int board_size, const char *args);
+
+    /* count solutions of board_size 1-based columns each, row after row */
+    void (*consume)(void *state, const int32_t *solutions, size_t count, int board_size);
+
+    /* Fold from into into; from is destroyed right after */
+    void (*merge)(void *into, void *from);
+
+    /* Called once on the merged state with the solver's solution count */
+    void (*finish)(void *state, long long total_solutions);
+
+    void (*destroy)(void *state);
+} nqueens_plugin_api;
+
+/* The one symbol a plugin exports */
+typedef const nqueens_plugin_api *(*nqueens_plugin_entry_fn)(void);
+#define NQUEENS_PLUGIN_ENTRY "nqueens_plugin_entry"
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ * Example plugin: how often each column holds the queen of each row.
+ * Prints an N x N table of counts when the run is done.
+ *
+ * cc -O2 -shared -fPIC -I.. column_histogram.c -o column_histogram.so
+ * ./nqueens_solver input.txt --plugin=./plugins/column_histogram.so
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "nqueens_plugin.h"
+
+typedef struct
+{
+    int board_size;
+    long long *counts; /* [row * board_size + column - 1] */
+} histogram;
+
+static void *create(int board_size, const char *args)
+{
+    (void)args;
+    histogram *state = malloc(sizeof(histogram));
+    state->board_size = board_size;
+    state->counts = calloc((size_t)board_size * board_size, sizeof(long long));
+    return state;
+}
+
+static void consume(void *state, const int32_t *solutions, size_t count, int board_size)
+{
+    histogram *h = state;
+    for (size_t i = 0; i < count; i++)
+        for (int row = 0; row < board_size; row++)
+            h->counts[row * board_size + solutions[i * board_size + row] - 1]++;
+}
+
+static void merge(void *into, void *from)
+{
+    histogram *a = into, *b = from;
+    for (int i = 0; i < a->board_size * a->board_size; i++)
+        a->counts[i] += b->counts[i];
+}
+
+static void finish(void *state, long long total_solutions)
+{
+    histogram *h = state;
+    printf("Column histogram over %lld solutions\n", total_solutions);
+    for (int row = 0; row < h->board_size; row++)
+    {
+        for (int col = 0; col < h->board_size; col++)
+            printf(col ? " %lld" : "%lld", h->counts[row * h->board_size + col]);
+        printf("\n");
+    }
+}
+
+static void destroy(void *state)
+{
+    histogram *h = state;
+    free(h->counts);
+    free(h);
+}
+
+static const nqueens_plugin_api api = {
+    NQUEENS_PLUGIN_ABI_VERSION, create, consume, merge, finish, destroy,
+};
+
+const nqueens_plugin_api *nqueens_plugin_entry(void)
+{
+    return &api;
+}
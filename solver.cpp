@@ -5,197 +5,5481 @@
 #include <cstdint>
 #include <cstdio>
 #include <chrono>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <deque>
+#include <algorithm>
+#include <numeric>
+#include <sstream>
+#include <random>
+#include <array>
+#include <utility>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <climits>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <csignal>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dlfcn.h>
+
+#include "nqueens_plugin.h"
 
 using namespace std;
 
-/* ---------------- CONFIGURATION ---------------- */
+/* ---------------- CONFIGURATION ---------------- */
+
+// Every row's columns fit one uint64_t mask, so N is at most this
+const int MAX_BOARD_SIZE = 64;
+
+// Search nodes between two looks at the job (cancellation, progress)
+const long long PROGRESS_POLL_NODES = 1 << 14;
+
+// Bytes buffered per search task before a write
+const int OUTPUT_BUFFER_SIZE = 65536;
+
+// Completion kernels are compiled separately for every N up to this
+const int MAX_SPECIALIZED_N = 16;
+
+// Instances of one N solved back to back by a single batch task
+const size_t BATCH_CHUNK_SIZE = 64;
+
+// Subtree cache: lock shards, the band of remaining rows where the search
+// looks up (all other depths run uncached), and the fewest search nodes
+// worth an entry
+const size_t CACHE_SHARDS = 64;
+const int CACHE_MIN_ROWS = 10;
+const int CACHE_MAX_ROWS = 12;
+const long long CACHE_MIN_COST = 1024;
+const size_t DEFAULT_CACHE_ENTRIES = 100000;
+
+// Default minimum time between two progress callbacks
+const chrono::milliseconds DEFAULT_PROGRESS_INTERVAL(250);
+
+// Tracing: a job's solution count fires a milestone probe every this many,
+// and a buffer write slower than this fires a writer stall probe
+const long long SOLUTION_MILESTONE = 1 << 20;
+const chrono::microseconds WRITER_STALL_THRESHOLD(10000);
+
+// Metrics: pool workers with their own counter slot (later ones share
+// the slot of all other threads), and the default time between two
+// textfile exports
+const int MAX_METRIC_THREADS = 256;
+const chrono::milliseconds DEFAULT_METRICS_INTERVAL(5000);
+
+// Solutions handed to a plugin per call
+const size_t PLUGIN_BATCH_SOLUTIONS = 1024;
+
+// Portfolio: nodes of the first random restart (doubling after each),
+// and local search steps per row before it starts over
+const long long PORTFOLIO_RESTART_NODES = 1000;
+const long long PORTFOLIO_LOCAL_STEPS = 100;
+
+// Planner: default rates until a plan is long enough to measure them at
+// PLAN_CALIBRATION_N; the shortest job worth splitting finer than the
+// first row, tasks wanted per thread, and the deepest split
+const double PLAN_DEFAULT_NODE_RATE = 5e7;
+const double PLAN_DEFAULT_NODES_PER_SOLUTION = 35;
+const double PLAN_DEFAULT_SECONDS_PER_RECORD = 2e-8;
+const double PLAN_MERGE_BYTES_PER_SECOND = 1e9;
+const int PLAN_CALIBRATION_N = 12;
+const double PLAN_CALIBRATION_SECONDS = 0.5;
+const double PLAN_SPLIT_SECONDS = 0.05;
+const int PLAN_TASKS_PER_THREAD = 8;
+const int PLAN_MAX_SPLIT_DEPTH = 3;
+
+// Plans of runs expected to take this long are logged to stderr
+const double PLAN_LOG_SECONDS = 1.0;
+
+// Enumerations to a file from this N on skip mirror halving, so the output
+// order is the canonical one and whatever was written when a run is
+// stopped is a prefix of it. Fixed, so a file's order never depends on
+// the machine that wrote it.
+const int ENUMERATION_LIMIT = 21;
+
+// Load generator defaults: requests per second and how long to send
+const double DEFAULT_LOAD_RATE = 100;
+const double DEFAULT_LOAD_SECONDS = 10;
+
+
+// Absolute diagonal indices of an N <= 64 board need up to 127 bits
+typedef unsigned __int128 DiagonalMask;
+
+// Every column of an N <= 64 board (a shift by 64 is undefined)
+uint64_t columnMask(int boardSize)
+{
+    return boardSize == 64 ? ~0ULL : (1ULL << boardSize) - 1;
+}
+
+
+/* ---------------- TRACING ---------------- */
+
+// USDT probes under the "nqueens" provider. A disabled probe is a single
+// nop in the binary; without <sys/sdt.h> they compile to nothing. Sample
+// bpftrace scripts are in tools/bpftrace.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define NQUEENS_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef NQUEENS_HAVE_SDT
+#define TRACE_PROBE1(name, a) DTRACE_PROBE1(nqueens, name, a)
+#define TRACE_PROBE2(name, a, b) DTRACE_PROBE2(nqueens, name, a, b)
+#define TRACE_PROBE3(name, a, b, c) DTRACE_PROBE3(nqueens, name, a, b, c)
+#else
+#define TRACE_PROBE1(name, a) ((void)0)
+#define TRACE_PROBE2(name, a, b) ((void)0)
+#define TRACE_PROBE3(name, a, b, c) ((void)0)
+#endif
+
+/* ---------------- METRICS ---------------- */
+
+// Counters of one thread. A thread only adds to its own slot, so nothing
+// is shared on the hot path; exporters sum the slots.
+struct alignas(64) ThreadMetrics
+{
+    atomic<long long> nodes{0};
+    atomic<long long> solutions{0};
+    atomic<long long> bytesWritten{0};
+    atomic<long long> tasks{0};
+    atomic<long long> busyNs{0};
+};
+
+// Pool workers live as long as the process and each get a slot. Short
+// lived threads (portfolio strategies, exporters) share one "other" slot,
+// so they never use up the slots or leave series behind.
+class MetricsRegistry
+{
+public:
+    // The calling thread's slot
+    ThreadMetrics &local()
+    {
+        ThreadMetrics *slot = localSlot();
+        return slot ? *slot : other;
+    }
+
+    // Called once by each pool worker before it counts anything
+    void claimWorkerSlot()
+    {
+        int index = nextSlot.fetch_add(1);
+        if (index < MAX_METRIC_THREADS)
+            localSlot() = &slots[index];
+    }
+
+    int workerCount() const { return min(nextSlot.load(), MAX_METRIC_THREADS); }
+    const ThreadMetrics &worker(int index) const { return slots[index]; }
+    const ThreadMetrics &others() const { return other; }
+
+    atomic<long long> queuedTasks{0};
+
+private:
+    static ThreadMetrics *&localSlot()
+    {
+        thread_local ThreadMetrics *slot = nullptr;
+        return slot;
+    }
+
+    array<ThreadMetrics, MAX_METRIC_THREADS> slots;
+    ThreadMetrics other;
+    atomic<int> nextSlot{0};
+};
+
+MetricsRegistry &metrics()
+{
+    static MetricsRegistry registry;
+    return registry;
+}
+
+/* ---------------- CANCELLATION ---------------- */
+
+// Shared flag checked cooperatively by the search kernel.
+// Copies of a token refer to the same flag.
+class CancellationToken
+{
+public:
+    CancellationToken() : flag(make_shared<atomic<bool>>(false)) {}
+
+    void cancel() const { flag->store(true, memory_order_relaxed); }
+    bool isCancelled() const { return flag->load(memory_order_relaxed); }
+
+private:
+    shared_ptr<atomic<bool>> flag;
+};
+
+
+/* ---------------- OUTPUT FORMATS ---------------- */
+
+enum class OutputFormat
+{
+    Text,
+    Csv,
+    JsonLines,
+    Binary
+};
+
+// Column (1-based) of a queen, or its mirror image
+template <bool Mirrored>
+inline int columnOf(const int *placement, int row, int boardSize)
+{
+    return Mirrored ? (boardSize + 1) - placement[row] : placement[row];
+}
+
+// Columns are at most 64, so never more than two digits
+inline char *formatColumn(char *out, int value)
+{
+    if (value >= 10)
+        *out++ = char('0' + value / 10);
+    *out++ = char('0' + value % 10);
+    return out;
+}
+
+template <bool Mirrored>
+inline char *formatSeparated(char *out, const int *placement, int boardSize,
+                             char separator)
+{
+    for (int i = 0; i < boardSize; i++)
+    {
+        out = formatColumn(out, columnOf<Mirrored>(placement, i, boardSize));
+        *out++ = separator;
+    }
+    out[-1] = '\n';
+    return out;
+}
+
+// "1 5 8 6 3 7 2 4", the original format
+struct TextFormat
+{
+    static const char *extension() { return ".txt"; }
+    static size_t maxRecordSize(int boardSize) { return 3 * boardSize + 1; }
+
+    static void writeHeader(ostream &out, int boardSize, long long solutions)
+    {
+        out << boardSize << "\n" << solutions << "\n";
+    }
+
+    template <bool Mirrored>
+    static char *format(char *out, const int *placement, int boardSize)
+    {
+        return formatSeparated<Mirrored>(out, placement, boardSize, ' ');
+    }
+};
+
+// "1,5,8,6,3,7,2,4" under a row1,...,rowN column header
+struct CsvFormat
+{
+    static const char *extension() { return ".csv"; }
+    static size_t maxRecordSize(int boardSize) { return 3 * boardSize + 1; }
+
+    static void writeHeader(ostream &out, int boardSize, long long)
+    {
+        for (int i = 1; i <= boardSize; i++)
+            out << "row" << i << (i < boardSize ? "," : "\n");
+    }
+
+    template <bool Mirrored>
+    static char *format(char *out, const int *placement, int boardSize)
+    {
+        return formatSeparated<Mirrored>(out, placement, boardSize, ',');
+    }
+};
+
+// "[1,5,8,6,3,7,2,4]" per line after a {"n":..,"solutions":..} line
+struct JsonLinesFormat
+{
+    static const char *extension() { return ".jsonl"; }
+    static size_t maxRecordSize(int boardSize) { return 3 * boardSize + 3; }
+
+    static void writeHeader(ostream &out, int boardSize, long long solutions)
+    {
+        out << "{\"n\":" << boardSize << ",\"solutions\":" << solutions << "}\n";
+    }
+
+    template <bool Mirrored>
+    static char *format(char *out, const int *placement, int boardSize)
+    {
+        *out++ = '[';
+        out = formatSeparated<Mirrored>(out, placement, boardSize, ',');
+        out[-1] = ']';
+        *out++ = '\n';
+        return out;
+    }
+};
+
+// "NQS1", uint32 N, uint64 count (native byte order), then one byte
+// per row holding the 1-based column
+struct BinaryFormat
+{
+    static const char *extension() { return ".bin"; }
+    static size_t maxRecordSize(int boardSize) { return boardSize; }
+
+    static void writeHeader(ostream &out, int boardSize, long long solutions)
+    {
+        uint32_t n = uint32_t(boardSize);
+        uint64_t count = uint64_t(solutions);
+        out.write("NQS1", 4);
+        out.write(reinterpret_cast<const char *>(&n), sizeof(n));
+        out.write(reinterpret_cast<const char *>(&count), sizeof(count));
+    }
+
+    template <bool Mirrored>
+    static char *format(char *out, const int *placement, int boardSize)
+    {
+        for (int i = 0; i < boardSize; i++)
+            *out++ = char(columnOf<Mirrored>(placement, i, boardSize));
+        return out;
+    }
+};
+
+// Calls action(Format()) with the policy class for a runtime choice
+template <class Action>
+auto withOutputFormat(OutputFormat format, Action &&action)
+{
+    switch (format)
+    {
+    case OutputFormat::Csv:
+        return action(CsvFormat());
+    case OutputFormat::JsonLines:
+        return action(JsonLinesFormat());
+    case OutputFormat::Binary:
+        return action(BinaryFormat());
+    default:
+        return action(TextFormat());
+    }
+}
+
+void writeOutputHeader(ostream &out, OutputFormat format, int boardSize,
+                       long long solutions)
+{
+    withOutputFormat(format, [&](auto policy)
+                     { decltype(policy)::writeHeader(out, boardSize, solutions); });
+}
+
+/* ---------------- FINGERPRINT ---------------- */
+
+// Order-independent digest of a set of solutions: the count plus the sum
+// (mod 2^64) of a 64-bit hash per solution. Each task keeps its own sum,
+// and any reader of the output recomputes it in a single pass.
+struct Fingerprint
+{
+    long long solutions = 0;
+    uint64_t hashSum = 0;
+};
+
+// splitmix64 finaliser
+inline uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// One fixed random key per (row, column) cell
+struct FingerprintKeys
+{
+    uint64_t key[64][65];
+
+    FingerprintKeys()
+    {
+        for (int row = 0; row < 64; row++)
+            for (int col = 0; col <= 64; col++)
+                key[row][col] = mix64(0x9e3779b97f4a7c15ULL * uint64_t(row * 65 + col + 1));
+    }
+};
+
+const FingerprintKeys FINGERPRINT_KEYS;
+
+template <bool Mirrored>
+inline uint64_t solutionHash(const int *placement, int boardSize)
+{
+    uint64_t cells = uint64_t(boardSize);
+    for (int i = 0; i < boardSize; i++)
+        cells ^= FINGERPRINT_KEYS.key[i][columnOf<Mirrored>(placement, i, boardSize)];
+    return mix64(cells);
+}
+
+string formatFingerprint(const Fingerprint &fingerprint)
+{
+    char text[40];
+    snprintf(text, sizeof(text), "%016llx/%lld",
+             (unsigned long long)fingerprint.hashSum, fingerprint.solutions);
+    return text;
+}
+
+/* ---------------- SOLUTION FILES ---------------- */
+
+struct SolutionFileHeader
+{
+    OutputFormat format = OutputFormat::Text;
+    int boardSize = 0;
+    long long solutions = -1;   // -1 when the format does not store it
+    bool noSolution = false;    // The "No Solution" file of N = 2, 3
+};
+
+// Output files only hold boards the solver can write
+bool isStorableBoardSize(int boardSize)
+{
+    return boardSize >= 1 && boardSize <= MAX_BOARD_SIZE;
+}
+
+// Recognises the format from the first bytes and reads the header
+bool readSolutionHeader(istream &in, SolutionFileHeader &header)
+{
+    char magic[4] = {};
+    in.read(magic, 4);
+    if (in.gcount() == 4 && string(magic, 4) == "NQS1")
+    {
+        uint32_t n;
+        uint64_t count;
+        in.read(reinterpret_cast<char *>(&n), sizeof(n));
+        in.read(reinterpret_cast<char *>(&count), sizeof(count));
+        header.format = OutputFormat::Binary;
+        header.boardSize = int(n);
+        header.solutions = (long long)count;
+        return bool(in) && isStorableBoardSize(header.boardSize);
+    }
+
+    in.clear();
+    in.seekg(0);
+    string line;
+    if (!getline(in, line))
+        return false;
+
+    if (line == "No Solution")
+    {
+        header.noSolution = true;
+        header.solutions = 0;
+        return true;
+    }
+
+    if (line.rfind("{", 0) == 0)
+    {
+        header.format = OutputFormat::JsonLines;
+        return sscanf(line.c_str(), "{\"n\":%d,\"solutions\":%lld}",
+                      &header.boardSize, &header.solutions) == 2 &&
+               isStorableBoardSize(header.boardSize);
+    }
+
+    if (line.rfind("row", 0) == 0)
+    {
+        header.format = OutputFormat::Csv;
+        header.boardSize = int(count(line.begin(), line.end(), ',')) + 1;
+        return isStorableBoardSize(header.boardSize);
+    }
+
+    header.format = OutputFormat::Text;
+    header.boardSize = atoi(line.c_str());
+    return bool(in >> header.solutions) && in.ignore() &&
+           isStorableBoardSize(header.boardSize);
+}
+
+// Reads one record into 1-based columns
+bool readRecord(istream &in, OutputFormat format, int boardSize, vector<int> &placement)
+{
+    placement.clear();
+
+    if (format == OutputFormat::Binary)
+    {
+        char record[64];
+        if (!in.read(record, boardSize))
+            return false;
+        for (int i = 0; i < boardSize; i++)
+            placement.push_back((unsigned char)record[i]);
+        return true;
+    }
+
+    string line;
+    if (!getline(in, line))
+        return false;
+
+    int value = -1;
+    for (char c : line)
+    {
+        if (c >= '0' && c <= '9')
+            value = (value < 0 ? 0 : value * 10) + (c - '0');
+        else if (value >= 0)
+        {
+            placement.push_back(value);
+            value = -1;
+        }
+    }
+    if (value >= 0)
+        placement.push_back(value);
+    return true;
+}
+
+bool isValidSolution(const vector<int> &placement, int boardSize)
+{
+    if (int(placement.size()) != boardSize)
+        return false;
+
+    uint64_t columns = 0;
+    DiagonalMask diagSum = 0, diagDiff = 0;
+    for (int row = 0; row < boardSize; row++)
+    {
+        int col = placement[row] - 1;
+        if (col < 0 || col >= boardSize ||
+            ((columns >> col) & 1) ||
+            ((diagSum >> (row + col)) & 1) ||
+            ((diagDiff >> (col - row + boardSize - 1)) & 1))
+            return false;
+
+        columns |= 1ULL << col;
+        diagSum |= DiagonalMask(1) << (row + col);
+        diagDiff |= DiagonalMask(1) << (col - row + boardSize - 1);
+    }
+    return true;
+}
+
+// Validates every record and computes the fingerprint in one pass
+bool checkSolutionFile(const string &path, SolutionFileHeader &header,
+                       Fingerprint &fingerprint, string &error)
+{
+    ifstream in(path, ios::binary);
+    if (!in || !readSolutionHeader(in, header))
+    {
+        error = "cannot read header of " + path;
+        return false;
+    }
+
+    vector<int> placement;
+    while (!header.noSolution && readRecord(in, header.format, header.boardSize, placement))
+    {
+        if (!isValidSolution(placement, header.boardSize))
+        {
+            error = "record " + to_string(fingerprint.solutions + 1) +
+                    " of " + path + " is not a valid solution";
+            return false;
+        }
+        fingerprint.solutions++;
+        fingerprint.hashSum += solutionHash<false>(placement.data(), header.boardSize);
+    }
+
+    if (header.solutions >= 0 && header.solutions != fingerprint.solutions)
+    {
+        error = path + " declares " + to_string(header.solutions) +
+                " solutions but holds " + to_string(fingerprint.solutions);
+        return false;
+    }
+    return true;
+}
+
+/* ---------------- SOLUTION VISITORS ---------------- */
+
+// Receives solutions inline at the search leaves. A job gives each worker
+// its own instance, so visit() needs no locking, and reduces them into
+// one when it is done.
+class SolutionVisitor
+{
+public:
+    virtual ~SolutionVisitor() = default;
+
+    // 1-based columns, one per row
+    virtual void visit(const int *placement, int boardSize) = 0;
+
+    // The task holding the instance is done with it for now
+    virtual void flush() {}
+};
+
+typedef function<unique_ptr<SolutionVisitor>()> VisitorFactory;
+typedef function<void(SolutionVisitor &into, SolutionVisitor &from)> VisitorReduce;
+
+/* ---------------- SEARCH STATE ---------------- */
+
+struct JobState;
+
+// Everything one search task touches while it runs. Each task owns
+// its state, so concurrent tasks never share a buffer or counter.
+struct SearchState
+{
+    int boardSize = 0;              // Size of the board (N)
+    uint64_t fullMask = 0;          // Mask with N lowest bits set
+    long long totalSolutions = 0;   // Count of solutions found
+    long long nodes = 0;            // Search nodes visited
+    bool terminateSearch = false;   // Stops recursion when cancelled
+
+    long long solutionLimit = LLONG_MAX; // Stop once this many are found
+    bool computeFingerprint = false;
+    uint64_t fingerprintSum = 0;     // Sum of solution hashes, this task only
+
+    // Polled every PROGRESS_POLL_NODES nodes; any of them may be null
+    const CancellationToken *cancelToken = nullptr;
+    const atomic<long long> *cutoffTask = nullptr; // Stop if taskIndex is past it
+    long long taskIndex = 0;
+    JobState *job = nullptr;        // Owning job, gets counts and progress
+    long long publishedNodes = 0;
+    long long publishedSolutions = 0;
+
+    FILE *solutionTempFile = nullptr; // Temporary file for solution storage
+    string *memoryOutput = nullptr;   // Or keep the records in memory
+    int outputFd = -1;                // Or pwrite them to the final file
+    long long outputOffset = 0;       // at this offset, which advances
+    bool writeFailed = false;         // A pwrite failed; the task stops
+    SolutionVisitor *visitor = nullptr; // Also sees every solution, may be null
+    OutputFormat outputFormat = OutputFormat::Text;
+
+    char outputBuffer[OUTPUT_BUFFER_SIZE];
+    int bufferIndex = 0;
+};
+
+void pollSearch(SearchState &state);
+
+inline bool shouldStop(SearchState &state)
+{
+    if ((++state.nodes & (PROGRESS_POLL_NODES - 1)) == 0)
+        pollSearch(state);
+    return state.terminateSearch;
+}
+
+inline bool writesOutput(const SearchState &state)
+{
+    return state.solutionTempFile || state.memoryOutput || state.outputFd >= 0;
+}
+
+/* ---------------- BUFFERED OUTPUT ---------------- */
+
+void flushOutput(SearchState &state)
+{
+    if (state.bufferIndex > 0)
+    {
+        TRACE_PROBE2(buffer__flush, state.taskIndex, state.bufferIndex);
+        metrics().local().bytesWritten.fetch_add(state.bufferIndex, memory_order_relaxed);
+
+        if (state.memoryOutput)
+            state.memoryOutput->append(state.outputBuffer, state.bufferIndex);
+        else if (state.solutionTempFile || state.outputFd >= 0)
+        {
+            auto writeStart = chrono::steady_clock::now();
+            if (state.solutionTempFile)
+                fwrite(state.outputBuffer, 1, state.bufferIndex, state.solutionTempFile);
+            else
+            {
+                // pwrite may write less than asked; retry the rest
+                for (int written = 0; written < state.bufferIndex;)
+                {
+                    ssize_t result = pwrite(state.outputFd, state.outputBuffer + written,
+                                            state.bufferIndex - written,
+                                            state.outputOffset + written);
+                    if (result < 0 && errno == EINTR)
+                        continue;
+                    if (result <= 0)
+                    {
+                        state.writeFailed = true;
+                        state.terminateSearch = true;
+                        break;
+                    }
+                    written += int(result);
+                }
+                state.outputOffset += state.bufferIndex;
+            }
+
+            auto writeTime = chrono::duration_cast<chrono::microseconds>(
+                chrono::steady_clock::now() - writeStart);
+            if (writeTime >= WRITER_STALL_THRESHOLD)
+                TRACE_PROBE3(writer__stall, state.taskIndex, state.bufferIndex,
+                             (long long)writeTime.count());
+        }
+        state.bufferIndex = 0;
+    }
+}
+
+/* ---------------- SOLUTION OUTPUT ---------------- */
+
+// Mirrored solutions reach the visitor of the task that found them
+template <bool Mirrored>
+inline void visitRecord(SearchState &state, const vector<int> &placement)
+{
+    if (!Mirrored)
+    {
+        state.visitor->visit(placement.data(), state.boardSize);
+        return;
+    }
+
+    int mirrored[64];
+    for (int row = 0; row < state.boardSize; row++)
+        mirrored[row] = columnOf<true>(placement.data(), row, state.boardSize);
+    state.visitor->visit(mirrored, state.boardSize);
+}
+
+// One bounds check per record: every format knows its largest record
+// and writes straight into the buffer. The fingerprint is taken here so it
+// covers exactly the records the task emits.
+template <class Format, bool Mirrored>
+inline void writeRecord(SearchState &state, const vector<int> &placement)
+{
+    if (state.computeFingerprint)
+        state.fingerprintSum += solutionHash<Mirrored>(placement.data(), state.boardSize);
+    if (state.visitor)
+        visitRecord<Mirrored>(state, placement);
+
+    if (!writesOutput(state))
+        return;
+
+    if (state.bufferIndex + Format::maxRecordSize(state.boardSize) > OUTPUT_BUFFER_SIZE)
+        flushOutput(state);
+
+    char *out = state.outputBuffer + state.bufferIndex;
+    char *end = Format::template format<Mirrored>(out, placement.data(), state.boardSize);
+    state.bufferIndex += int(end - out);
+}
+
+template <class Format>
+void writeSolution(SearchState &state, const vector<int> &placement)
+{
+    writeRecord<Format, false>(state, placement);
+}
+
+template <class Format>
+void writeMirroredSolution(SearchState &state, const vector<int> &placement)
+{
+    writeRecord<Format, true>(state, placement);
+}
+
+/* ---------------- BACKTRACKING SOLVER ---------------- */
+
+template <class Format>
+void backtrack(SearchState &state, uint64_t columns, uint64_t diagLeft,
+               uint64_t diagRight, vector<int> &placement)
+{
+    if (shouldStop(state))
+        return;
+
+    // All columns occupied -> valid solution
+    if (columns == state.fullMask)
+    {
+        state.totalSolutions++;
+        writeSolution<Format>(state, placement);
+
+        if (state.totalSolutions >= state.solutionLimit)
+            state.terminateSearch = true;
+        return;
+    }
+
+    // Calculate available positions
+    uint64_t available =
+        ~(columns | diagLeft | diagRight) & state.fullMask;
+
+    while (available)
+    {
+        if (state.terminateSearch)
+            return;
+
+        // Select the lowest available column
+        uint64_t bit = available & -available;
+        available -= bit;
+
+        int colIndex = __builtin_ctzll(bit);
+
+        placement.push_back(colIndex + 1);
+
+        backtrack<Format>(state,
+                  columns | bit,
+                  (diagLeft | bit) << 1,
+                  (diagRight | bit) >> 1,
+                  placement);
+
+        placement.pop_back(); // undo placement
+    }
+}
+
+// Same search, but every solution is also written mirrored
+// (column k -> N + 1 - k), covering the other half of the first row.
+template <class Format>
+void mirroredBacktrack(SearchState &state, uint64_t columns, uint64_t diagLeft,
+                       uint64_t diagRight, vector<int> &placement)
+{
+    if (shouldStop(state))
+        return;
+
+    if (columns == state.fullMask)
+    {
+        state.totalSolutions++;
+        writeSolution<Format>(state, placement);
+
+        state.totalSolutions++;
+        writeMirroredSolution<Format>(state, placement);
+        return;
+    }
+
+    uint64_t possible = ~(columns | diagLeft | diagRight) & state.fullMask;
+    while (possible)
+    {
+        if (state.terminateSearch)
+            return;
+
+        uint64_t bit = possible & -possible;
+        possible -= bit;
+
+        placement.push_back(__builtin_ctzll(bit) + 1);
+        mirroredBacktrack<Format>(state,
+                          columns | bit,
+                          (diagLeft | bit) << 1,
+                          (diagRight | bit) >> 1,
+                          placement);
+        placement.pop_back();
+    }
+}
+
+/* ---------------- ROTATION INVARIANT SOLVER ---------------- */
+
+// Board with absolute diagonal indices, so a whole rotation orbit can be
+// placed at once even though its queens are spread over the board.
+struct RotationBoard
+{
+    int boardSize = 0;
+    int quarterTurns = 0;       // 1 -> 90 degrees, 2 -> 180 degrees
+    uint64_t rows = 0;
+    uint64_t columns = 0;
+    DiagonalMask diagSum = 0;   // bit r + c
+    DiagonalMask diagDiff = 0;  // bit c - r + N - 1
+    vector<int> placement;      // column + 1 per row, 0 while empty
+};
+
+inline bool isCellFree(const RotationBoard &board, int row, int col)
+{
+    return !((board.rows >> row) & 1) &&
+           !((board.columns >> col) & 1) &&
+           !((board.diagSum >> (row + col)) & 1) &&
+           !((board.diagDiff >> (col - row + board.boardSize - 1)) & 1);
+}
+
+inline void toggleQueen(RotationBoard &board, int row, int col)
+{
+    board.rows ^= 1ULL << row;
+    board.columns ^= 1ULL << col;
+    board.diagSum ^= DiagonalMask(1) << (row + col);
+    board.diagDiff ^= DiagonalMask(1) << (col - row + board.boardSize - 1);
+    board.placement[row] = board.placement[row] ? 0 : col + 1;
+}
+
+// Places (row, col) and its images under the board's rotation.
+// Returns the orbit size, or 0 (board unchanged) if any cell is attacked.
+int placeOrbit(RotationBoard &board, int row, int col)
+{
+    int n = board.boardSize;
+    int cells[4][2];
+    int placed = 0;
+
+    int r = row, c = col;
+    do
+    {
+        if (!isCellFree(board, r, c))
+        {
+            while (placed--)
+                toggleQueen(board, cells[placed][0], cells[placed][1]);
+            return 0;
+        }
+        toggleQueen(board, r, c);
+        cells[placed][0] = r;
+        cells[placed][1] = c;
+        placed++;
+
+        for (int turn = 0; turn < board.quarterTurns; turn++)
+        {
+            int rotated = c;
+            c = n - 1 - r;
+            r = rotated;
+        }
+    } while (r != row || c != col);
+
+    return placed;
+}
+
+void removeOrbit(RotationBoard &board, int row, int col)
+{
+    int n = board.boardSize;
+    int r = row, c = col;
+    do
+    {
+        toggleQueen(board, r, c);
+        for (int turn = 0; turn < board.quarterTurns; turn++)
+        {
+            int rotated = c;
+            c = n - 1 - r;
+            r = rotated;
+        }
+    } while (r != row || c != col);
+}
+
+// Fills the topmost empty row together with the rest of its orbit, so
+// only a half (180) or a quarter (90) of the rows are branched on.
+template <class Format>
+void rotationBacktrack(SearchState &state, RotationBoard &board, bool mirrored)
+{
+    if (shouldStop(state))
+        return;
+
+    if (board.rows == state.fullMask)
+    {
+        state.totalSolutions++;
+        writeSolution<Format>(state, board.placement);
+
+        if (mirrored)
+        {
+            state.totalSolutions++;
+            writeMirroredSolution<Format>(state, board.placement);
+        }
+        return;
+    }
+
+    int row = __builtin_ctzll(~board.rows);
+    uint64_t available =
+        ~(board.columns |
+          uint64_t(board.diagSum >> row) |
+          uint64_t(board.diagDiff >> (board.boardSize - 1 - row))) & state.fullMask;
+
+    while (available)
+    {
+        if (state.terminateSearch)
+            return;
+
+        uint64_t bit = available & -available;
+        available -= bit;
+
+        int col = __builtin_ctzll(bit);
+        if (placeOrbit(board, row, col))
+        {
+            rotationBacktrack<Format>(state, board, mirrored);
+            removeOrbit(board, row, col);
+        }
+    }
+}
+
+/* ---------------- NO-THREE-IN-LINE SOLVER ---------------- */
+
+// Queens solutions where no three queens share any straight line. Each
+// new queen extends the lines through it and every earlier queen into the
+// rows below, so the collinear cells are pruned with the usual bitmasks.
+struct NoThreeBoard
+{
+    int boardSize = 0;
+    vector<uint64_t> lineBlocked;   // [depth * N + row]: cells on a queen pair's line
+    vector<int> stepRows;           // [dr * (2N - 1) + dc + N - 1]: gcd-reduced step
+    vector<int> stepColumns;
+};
+
+void prepareNoThreeBoard(NoThreeBoard &board, int boardSize)
+{
+    int width = 2 * boardSize - 1;
+    board.boardSize = boardSize;
+    board.lineBlocked.assign(size_t(boardSize + 1) * boardSize, 0);
+    board.stepRows.assign(size_t(boardSize) * width, 0);
+    board.stepColumns.assign(size_t(boardSize) * width, 0);
+
+    for (int dr = 1; dr < boardSize; dr++)
+        for (int dc = -(boardSize - 1); dc < boardSize; dc++)
+        {
+            int divisor = gcd(dr, abs(dc));
+            board.stepRows[dr * width + dc + boardSize - 1] = dr / divisor;
+            board.stepColumns[dr * width + dc + boardSize - 1] = dc / divisor;
+        }
+}
+
+// Blocked cells for depth row + 1 after a queen at (row, col)
+void extendQueenLines(NoThreeBoard &board, int row, int col, const vector<int> &placement)
+{
+    int n = board.boardSize;
+    int width = 2 * n - 1;
+    const uint64_t *current = &board.lineBlocked[size_t(row) * n];
+    uint64_t *next = &board.lineBlocked[size_t(row + 1) * n];
+    copy(current + row + 1, current + n, next + row + 1);
+
+    for (int earlier = 0; earlier < row; earlier++)
+    {
+        int dc = col - (placement[earlier] - 1);
+        int index = (row - earlier) * width + dc + n - 1;
+        int stepRow = board.stepRows[index];
+        int stepColumn = board.stepColumns[index];
+
+        for (int r = row + stepRow, c = col + stepColumn;
+             r < n && c >= 0 && c < n;
+             r += stepRow, c += stepColumn)
+            next[r] |= 1ULL << c;
+    }
+}
+
+template <class Format>
+void noThreeBacktrack(SearchState &state, NoThreeBoard &board, uint64_t columns,
+                      uint64_t diagLeft, uint64_t diagRight,
+                      vector<int> &placement, bool mirrored)
+{
+    if (shouldStop(state))
+        return;
+
+    int row = int(placement.size());
+    if (row == state.boardSize)
+    {
+        state.totalSolutions++;
+        writeSolution<Format>(state, placement);
+
+        if (mirrored)
+        {
+            state.totalSolutions++;
+            writeMirroredSolution<Format>(state, placement);
+        }
+        return;
+    }
+
+    uint64_t available = ~(columns | diagLeft | diagRight |
+                           board.lineBlocked[size_t(row) * state.boardSize + row]) &
+                         state.fullMask;
+    while (available)
+    {
+        if (state.terminateSearch)
+            return;
+
+        uint64_t bit = available & -available;
+        available -= bit;
+
+        int col = __builtin_ctzll(bit);
+        extendQueenLines(board, row, col, placement);
+        placement.push_back(col + 1);
+
+        noThreeBacktrack<Format>(state, board,
+                                 columns | bit,
+                                 (diagLeft | bit) << 1,
+                                 (diagRight | bit) >> 1,
+                                 placement, mirrored);
+        placement.pop_back();
+    }
+}
+
+/* ---------------- SYMMETRY OPTIMIZED SOLVER ---------------- */
+
+// One independent piece of the search: fixed columns for the first
+// rows, optionally also producing the mirrored solutions.
+struct SearchTask
+{
+    vector<int> prefix;     // 0-based column per leading row
+    bool mirrored;
+    int invariantRotation;  // 0, or 90 / 180 for rotation-invariant search
+    bool noThreeInLine = false;
+};
+
+// Splits the search by first-row column. Output of the tasks, concatenated
+// in this order, is the solution list of the whole board. Mirroring keeps
+// every line a line, so no-three-in-line uses the same plan; rotation
+// invariance is only searched for the plain problem, which may also be
+// searched whole, without mirroring.
+vector<SearchTask> planSearchTasks(int boardSize, int invariantRotation = 0,
+                                   bool noThreeInLine = false, bool mirrorHalving = true)
+{
+    vector<SearchTask> tasks;
+
+    if (noThreeInLine)
+    {
+        tasks = planSearchTasks(boardSize);
+        for (SearchTask &task : tasks)
+            task.noThreeInLine = true;
+        return tasks;
+    }
+
+    if (invariantRotation)
+    {
+        // 90 degree orbits need N = 0 or 1 (mod 4)
+        if (invariantRotation == 90 && boardSize % 4 > 1)
+            return tasks;
+
+        // Mirroring keeps rotation invariance, and the centre column of
+        // the first row always clashes with the centre queen (odd N)
+        if (boardSize == 1)
+            tasks.push_back({{0}, false, invariantRotation});
+        for (int col = 0; col < boardSize / 2; col++)
+            tasks.push_back({{col}, true, invariantRotation});
+        return tasks;
+    }
+
+    if (!mirrorHalving)
+    {
+        for (int col = 0; col < boardSize; col++)
+            tasks.push_back({{col}, false, 0});
+        return tasks;
+    }
+
+    // Explore only half the first row (mirrors cover the rest)
+    int halfColumns = boardSize / 2;
+    for (int col = 0; col < halfColumns; col++)
+        tasks.push_back({{col}, true, 0});
+
+    // Handle middle column separately for odd N
+    if (boardSize % 2 == 1)
+        tasks.push_back({{boardSize / 2}, false, 0});
+
+    return tasks;
+}
+
+// Replaces every task by one task per open column of its next row, in
+// column order. The concatenated output of the pieces is the output of the
+// task they came from. Rotation tasks place whole orbits and stay as they are.
+vector<SearchTask> splitSearchTasks(const vector<SearchTask> &tasks, int boardSize, int depth)
+{
+    vector<SearchTask> result = tasks;
+    for (int level = 1; level < depth; level++)
+    {
+        vector<SearchTask> deeper;
+        for (const SearchTask &task : result)
+        {
+            if (task.invariantRotation || int(task.prefix.size()) >= boardSize)
+            {
+                deeper.push_back(task);
+                continue;
+            }
+
+            uint64_t columns = 0, diagLeft = 0, diagRight = 0;
+            for (int col : task.prefix)
+            {
+                uint64_t bit = 1ULL << col;
+                columns |= bit;
+                diagLeft = (diagLeft | bit) << 1;
+                diagRight = (diagRight | bit) >> 1;
+            }
+
+            uint64_t fullMask = columnMask(boardSize);
+            for (uint64_t available = ~(columns | diagLeft | diagRight) & fullMask;
+                 available; available &= available - 1)
+            {
+                SearchTask piece = task;
+                piece.prefix.push_back(__builtin_ctzll(available));
+                deeper.push_back(piece);
+            }
+        }
+        result = move(deeper);
+    }
+    return result;
+}
+
+template <class Format>
+void runRotationTask(SearchState &state, const SearchTask &task)
+{
+    RotationBoard board;
+    board.boardSize = state.boardSize;
+    board.quarterTurns = task.invariantRotation / 90;
+    board.placement.assign(state.boardSize, 0);
+
+    // An invariant solution of odd N holds the centre cell
+    if (state.boardSize % 2 == 1)
+        placeOrbit(board, state.boardSize / 2, state.boardSize / 2);
+
+    if (!(board.rows & 1) && !placeOrbit(board, 0, task.prefix[0]))
+        return;
+
+    rotationBacktrack<Format>(state, board, task.mirrored);
+}
+
+template <class Format>
+void runSearchTaskAs(SearchState &state, const SearchTask &task)
+{
+    if (task.invariantRotation)
+    {
+        runRotationTask<Format>(state, task);
+        return;
+    }
+
+    vector<int> placement;
+    uint64_t columns = 0, diagLeft = 0, diagRight = 0;
+    for (int col : task.prefix)
+    {
+        uint64_t bit = 1ULL << col;
+        placement.push_back(col + 1);
+        columns |= bit;
+        diagLeft = (diagLeft | bit) << 1;
+        diagRight = (diagRight | bit) >> 1;
+    }
+
+    if (task.noThreeInLine)
+    {
+        NoThreeBoard board;
+        prepareNoThreeBoard(board, state.boardSize);
+        vector<int> prefix;
+        for (int col : task.prefix)
+        {
+            // A split prefix may already hold three queens in a line
+            int row = int(prefix.size());
+            if ((board.lineBlocked[size_t(row) * state.boardSize + row] >> col) & 1)
+                return;
+            extendQueenLines(board, row, col, prefix);
+            prefix.push_back(col + 1);
+        }
+        noThreeBacktrack<Format>(state, board, columns, diagLeft, diagRight,
+                                 placement, task.mirrored);
+    }
+    else if (task.mirrored)
+        mirroredBacktrack<Format>(state, columns, diagLeft, diagRight, placement);
+    else
+        backtrack<Format>(state, columns, diagLeft, diagRight, placement);
+}
+
+// The output format is resolved once per task, not per solution
+void runSearchTask(SearchState &state, const SearchTask &task)
+{
+    withOutputFormat(state.outputFormat, [&](auto policy)
+                     { runSearchTaskAs<decltype(policy)>(state, task); });
+}
+
+/* ---------------- SUBTREE CACHE ---------------- */
+
+// The open columns of each remaining row, for CACHE_MIN_ROWS to
+// CACHE_MAX_ROWS rows; masks past `rows` stay zero
+struct ResidualKey
+{
+    array<uint64_t, CACHE_MAX_ROWS> masks = {};
+    int rows = 0;
+
+    bool operator==(const ResidualKey &other) const
+    {
+        return rows == other.rows && masks == other.masks;
+    }
+};
+
+struct ResidualKeyHash
+{
+    size_t operator()(const ResidualKey &key) const
+    {
+        uint64_t hash = uint64_t(key.rows);
+        for (int row = 0; row < key.rows; row++)
+        {
+            hash = (hash ^ key.masks[row]) * 0x9e3779b97f4a7c15ULL;
+            hash ^= hash >> 29;
+        }
+        return size_t(hash);
+    }
+};
+
+// What the rest of a completion search yields from a residual board
+struct SubtreeValue
+{
+    long long solutions = 0;
+    vector<int> firstCompletion;    // Columns of the remaining rows, if known
+};
+
+struct CacheStats
+{
+    long long entries = 0;
+    long long lookups = 0;
+    long long hits = 0;
+    long long warmHits = 0;         // Hits answered from a warm snapshot
+    long long inserts = 0;
+    long long evictions = 0;
+};
+
+// Second place to look on a miss (a warm snapshot): fills in the value and
+// its cost and returns true if the key is there
+typedef function<bool(const ResidualKey &, SubtreeValue &, long long &)> CacheFallback;
+
+// Bounded map from residual board to SubtreeValue, shared by concurrent
+// queries. Sharded by key hash, each shard evicts GreedyDual style: an
+// entry ranks by the search nodes it saves plus the shard's inflation,
+// which rises to the rank of every evicted entry, so cheap and stale
+// entries leave first. A capacity below CACHE_SHARDS uses one shard per
+// entry; a capacity of 0 disables the cache.
+class SubtreeCache
+{
+public:
+    explicit SubtreeCache(size_t capacity)
+        : shardCount(max<size_t>(1, min(capacity, CACHE_SHARDS))),
+          shardCapacity(capacity / shardCount) {}
+
+    // Callers pass no cache at all instead of a disabled one
+    bool enabled() const { return shardCapacity > 0; }
+
+    // Entries without a first completion only answer count questions
+    bool lookup(const ResidualKey &key, bool needFirstCompletion, SubtreeValue &value)
+    {
+        lookups.fetch_add(1, memory_order_relaxed);
+        Shard &shard = shardFor(key);
+        lock_guard<mutex> lock(shard.shardMutex);
+
+        auto found = shard.entries.find(key);
+        if (found == shard.entries.end())
+        {
+            long long cost;
+            if (!fallback || !fallback(key, value, cost))
+                return false;
+            found = place(shard, key, value, cost);
+            warmHits.fetch_add(1, memory_order_relaxed);
+        }
+
+        Entry &entry = found->second;
+        if (needFirstCompletion && entry.value.solutions > 0 &&
+            entry.value.firstCompletion.empty())
+            return false;
+
+        shard.byRank.erase(entry.rank);
+        entry.rank = shard.byRank.emplace(shard.inflation + double(entry.cost), &found->first);
+        value = entry.value;
+        hits.fetch_add(1, memory_order_relaxed);
+        return true;
+    }
+
+    void insert(const ResidualKey &key, const SubtreeValue &value, long long cost)
+    {
+        Shard &shard = shardFor(key);
+        lock_guard<mutex> lock(shard.shardMutex);
+
+        auto found = shard.entries.find(key);
+        if (found != shard.entries.end())
+        {
+            if (found->second.value.firstCompletion.empty())
+                found->second.value = value;
+            return;
+        }
+
+        place(shard, key, value, cost);
+        inserts.fetch_add(1, memory_order_relaxed);
+    }
+
+    // Set before the cache is shared; entries found there move in
+    void setFallback(CacheFallback source) { fallback = move(source); }
+
+    // Calls visit(key, value, cost) for every entry, one shard at a time
+    template <typename Visit>
+    void forEach(Visit visit) const
+    {
+        for (const Shard &shard : shards)
+        {
+            lock_guard<mutex> lock(shard.shardMutex);
+            for (const auto &entry : shard.entries)
+                visit(entry.first, entry.second.value, entry.second.cost);
+        }
+    }
+
+    size_t capacity() const { return shardCapacity * shardCount; }
+
+    CacheStats stats() const
+    {
+        CacheStats result;
+        for (const Shard &shard : shards)
+        {
+            lock_guard<mutex> lock(shard.shardMutex);
+            result.entries += (long long)shard.entries.size();
+        }
+        result.lookups = lookups.load(memory_order_relaxed);
+        result.hits = hits.load(memory_order_relaxed);
+        result.warmHits = warmHits.load(memory_order_relaxed);
+        result.inserts = inserts.load(memory_order_relaxed);
+        result.evictions = evictions.load(memory_order_relaxed);
+        return result;
+    }
+
+private:
+    typedef multimap<double, const ResidualKey *> RankIndex;
+
+    struct Entry
+    {
+        SubtreeValue value;
+        long long cost;
+        RankIndex::iterator rank;
+    };
+
+    typedef unordered_map<ResidualKey, Entry, ResidualKeyHash> EntryMap;
+
+    struct Shard
+    {
+        mutable mutex shardMutex;
+        EntryMap entries;
+        RankIndex byRank;
+        double inflation = 0;
+    };
+
+    Shard &shardFor(const ResidualKey &key)
+    {
+        return shards[ResidualKeyHash()(key) % shardCount];
+    }
+
+    // Adds a new entry, evicting the lowest ranked one of a full shard
+    EntryMap::iterator place(Shard &shard, const ResidualKey &key,
+                             const SubtreeValue &value, long long cost)
+    {
+        if (shard.entries.size() >= shardCapacity)
+        {
+            auto victim = shard.byRank.begin();
+            shard.inflation = victim->first;
+            ResidualKey victimKey = *victim->second;
+            shard.byRank.erase(victim);
+            shard.entries.erase(victimKey);
+            evictions.fetch_add(1, memory_order_relaxed);
+        }
+
+        auto placed = shard.entries.emplace(key, Entry{value, cost, {}}).first;
+        placed->second.rank = shard.byRank.emplace(shard.inflation + double(cost), &placed->first);
+        return placed;
+    }
+
+    array<Shard, CACHE_SHARDS> shards;
+    size_t shardCount;
+    size_t shardCapacity;
+    CacheFallback fallback;
+    atomic<long long> lookups{0};
+    atomic<long long> hits{0};
+    atomic<long long> warmHits{0};
+    atomic<long long> inserts{0};
+    atomic<long long> evictions{0};
+};
+
+/* ---------------- COMPLETION SOLVER ---------------- */
+
+// A partially filled board: queens that must stay where they are and
+// cells that may not hold a queen.
+struct CompletionInstance
+{
+    int boardSize = 0;
+    vector<int> fixedColumns;   // 1-based column per row, 0 = free
+    vector<uint64_t> blocked;   // Forbidden columns per row, may be empty
+};
+
+struct CompletionResult
+{
+    long long solutions = 0;        // Capped at the search limit
+    vector<int> firstCompletion;    // 1-based columns, empty if none
+    string error;                   // Set for a malformed instance
+};
+
+struct CompletionSearch
+{
+    int boardSize = 0;
+    vector<uint64_t> allowed;       // Columns still possible per row
+    long long limit = LLONG_MAX;
+    long long solutions = 0;
+    long long nodes = 0;
+    vector<int> placement;
+    vector<int> firstCompletion;
+    const CancellationToken *cancelToken = nullptr;
+    SubtreeCache *cache = nullptr;  // Shared across queries, may be null
+    bool stopped = false;
+};
+
+bool isValidInstance(const CompletionInstance &instance)
+{
+    int n = instance.boardSize;
+    if (n < 1 || n > 64 || int(instance.fixedColumns.size()) != n ||
+        int(instance.blocked.size()) > n)
+        return false;
+
+    for (int col : instance.fixedColumns)
+        if (col < 0 || col > n)
+            return false;
+    return true;
+}
+
+// Cells attacked by a fixed queen are removed up front, so the search
+// only has to resolve conflicts between the free rows
+void computeAllowedColumns(const CompletionInstance &instance, vector<uint64_t> &allowed)
+{
+    int n = instance.boardSize;
+    allowed.assign(n, columnMask(n));
+
+    for (int row = 0; row < n && row < int(instance.blocked.size()); row++)
+        allowed[row] &= ~instance.blocked[row];
+
+    for (int row = 0; row < n; row++)
+    {
+        int col = instance.fixedColumns[row] - 1;
+        if (col < 0)
+            continue;
+
+        for (int other = 0; other < n; other++)
+        {
+            if (other == row)
+            {
+                allowed[other] &= 1ULL << col;
+                continue;
+            }
+
+            int distance = abs(other - row);
+            uint64_t attacked = 1ULL << col;
+            if (col + distance < n)
+                attacked |= 1ULL << (col + distance);
+            if (col - distance >= 0)
+                attacked |= 1ULL << (col - distance);
+            allowed[other] &= ~attacked;
+        }
+    }
+}
+
+void completionChildren(CompletionSearch &search, int row, uint64_t columns,
+                        uint64_t diagLeft, uint64_t diagRight);
+void cachedCompletionBacktrack(CompletionSearch &search, int row, uint64_t columns,
+                               uint64_t diagLeft, uint64_t diagRight);
+
+void completionBacktrack(CompletionSearch &search, int row, uint64_t columns,
+                         uint64_t diagLeft, uint64_t diagRight)
+{
+    if (search.stopped)
+        return;
+
+    if ((++search.nodes & (PROGRESS_POLL_NODES - 1)) == 0 &&
+        search.cancelToken && search.cancelToken->isCancelled())
+    {
+        search.stopped = true;
+        return;
+    }
+
+    if (row == search.boardSize)
+    {
+        if (search.solutions++ == 0)
+            search.firstCompletion = search.placement;
+        if (search.solutions >= search.limit)
+            search.stopped = true;
+        return;
+    }
+
+    int rowsLeft = search.boardSize - row;
+    if (search.cache && rowsLeft >= CACHE_MIN_ROWS && rowsLeft <= CACHE_MAX_ROWS)
+        cachedCompletionBacktrack(search, row, columns, diagLeft, diagRight);
+    else
+        completionChildren(search, row, columns, diagLeft, diagRight);
+}
+
+void completionChildren(CompletionSearch &search, int row, uint64_t columns,
+                        uint64_t diagLeft, uint64_t diagRight)
+{
+    uint64_t available = ~(columns | diagLeft | diagRight) & search.allowed[row];
+    while (available && !search.stopped)
+    {
+        uint64_t bit = available & -available;
+        available -= bit;
+
+        search.placement[row] = __builtin_ctzll(bit) + 1;
+        completionBacktrack(search, row + 1,
+                            columns | bit,
+                            (diagLeft | bit) << 1,
+                            (diagRight | bit) >> 1);
+    }
+}
+
+// The remaining rows' allowed columns minus every cell the placed queens
+// attack. Nothing else about the prefix matters to the rest of the
+// search, so equal keys from different queries share one result.
+ResidualKey residualKey(const CompletionSearch &search, int row, uint64_t columns,
+                        uint64_t diagLeft, uint64_t diagRight)
+{
+    ResidualKey key;
+    key.rows = search.boardSize - row;
+    for (int next = 0; next < key.rows; next++)
+    {
+        key.masks[next] = search.allowed[row + next] & ~(columns | diagLeft | diagRight);
+        diagLeft <<= 1;
+        diagRight >>= 1;
+    }
+    return key;
+}
+
+// Answers the subtree from the cache, or searches it and stores the
+// result if it was searched to the end
+void cachedCompletionBacktrack(CompletionSearch &search, int row, uint64_t columns,
+                               uint64_t diagLeft, uint64_t diagRight)
+{
+    ResidualKey key = residualKey(search, row, columns, diagLeft, diagRight);
+    bool needFirst = search.solutions == 0;
+
+    SubtreeValue value;
+    if (search.cache->lookup(key, needFirst, value))
+    {
+        if (needFirst && value.solutions > 0)
+        {
+            search.firstCompletion = search.placement;
+            copy(value.firstCompletion.begin(), value.firstCompletion.end(),
+                 search.firstCompletion.begin() + row);
+        }
+        search.solutions += value.solutions;
+        if (search.solutions >= search.limit)
+            search.stopped = true;
+        return;
+    }
+
+    long long solutionsBefore = search.solutions;
+    long long nodesBefore = search.nodes;
+    completionChildren(search, row, columns, diagLeft, diagRight);
+
+    long long cost = search.nodes - nodesBefore;
+    if (search.stopped || cost < CACHE_MIN_COST)
+        return;
+
+    value.solutions = search.solutions - solutionsBefore;
+    if (needFirst && value.solutions > 0)
+        value.firstCompletion.assign(search.firstCompletion.begin() + row,
+                                     search.firstCompletion.end());
+    search.cache->insert(key, value, cost);
+}
+
+// Same search with N and the row as template arguments: the recursion is
+// unrolled and every mask test is against a compile-time depth.
+template <int N, int Row>
+void fixedCompletionBacktrack(CompletionSearch &search, uint64_t columns,
+                              uint64_t diagLeft, uint64_t diagRight)
+{
+    if ((++search.nodes & (PROGRESS_POLL_NODES - 1)) == 0 &&
+        search.cancelToken && search.cancelToken->isCancelled())
+        search.stopped = true;
+    if (search.stopped)
+        return;
+
+    if constexpr (Row == N)
+    {
+        if (search.solutions++ == 0)
+            search.firstCompletion = search.placement;
+        if (search.solutions >= search.limit)
+            search.stopped = true;
+    }
+    else
+    {
+        uint64_t available = ~(columns | diagLeft | diagRight) & search.allowed[Row];
+        while (available && !search.stopped)
+        {
+            uint64_t bit = available & -available;
+            available -= bit;
+
+            search.placement[Row] = __builtin_ctzll(bit) + 1;
+            fixedCompletionBacktrack<N, Row + 1>(search,
+                                                 columns | bit,
+                                                 (diagLeft | bit) << 1,
+                                                 (diagRight | bit) >> 1);
+        }
+    }
+}
+
+typedef void (*CompletionKernel)(CompletionSearch &);
+
+template <int N>
+void fixedCompletionKernel(CompletionSearch &search)
+{
+    fixedCompletionBacktrack<N, 0>(search, 0, 0, 0);
+}
+
+void runtimeCompletionKernel(CompletionSearch &search)
+{
+    completionBacktrack(search, 0, 0, 0, 0);
+}
+
+template <size_t... Sizes>
+constexpr array<CompletionKernel, sizeof...(Sizes)> makeCompletionKernels(index_sequence<Sizes...>)
+{
+    return {{&fixedCompletionKernel<int(Sizes) + 1>...}};
+}
+
+const array<CompletionKernel, MAX_SPECIALIZED_N> SPECIALIZED_COMPLETION_KERNELS =
+    makeCompletionKernels(make_index_sequence<MAX_SPECIALIZED_N>());
+
+CompletionKernel completionKernelFor(int boardSize)
+{
+    if (boardSize >= 1 && boardSize <= MAX_SPECIALIZED_N)
+        return SPECIALIZED_COMPLETION_KERNELS[boardSize - 1];
+    return runtimeCompletionKernel;
+}
+
+// Resets a search for the next instance, reusing its buffers
+void prepareCompletion(CompletionSearch &search, const CompletionInstance &instance,
+                       long long limit)
+{
+    search.boardSize = instance.boardSize;
+    computeAllowedColumns(instance, search.allowed);
+    search.limit = limit;
+    search.solutions = 0;
+    search.nodes = 0;
+    search.placement.assign(instance.boardSize, 0);
+    search.firstCompletion.clear();
+
+    // A row with no possible column: nothing to search
+    search.stopped = any_of(search.allowed.begin(), search.allowed.end(),
+                            [](uint64_t allowed) { return allowed == 0; });
+}
+
+CompletionResult takeCompletionResult(CompletionSearch &search)
+{
+    // Cached subtrees are added whole and may overshoot the limit
+    CompletionResult result;
+    result.solutions = min(search.solutions, search.limit);
+    result.firstCompletion = move(search.firstCompletion);
+
+    ThreadMetrics &counters = metrics().local();
+    counters.nodes.fetch_add(search.nodes, memory_order_relaxed);
+    counters.solutions.fetch_add(result.solutions, memory_order_relaxed);
+    return result;
+}
+
+// Counts completions of the instance, stopping once `limit` are found
+CompletionResult solveCompletion(const CompletionInstance &instance,
+                                 long long limit = LLONG_MAX,
+                                 const CancellationToken *cancelToken = nullptr,
+                                 SubtreeCache *cache = nullptr)
+{
+    CompletionSearch search;
+    prepareCompletion(search, instance, limit);
+    search.cancelToken = cancelToken;
+    search.cache = cache;
+
+    // Only the runtime kernel consults the cache
+    CompletionKernel kernel = cache ? runtimeCompletionKernel
+                                    : completionKernelFor(instance.boardSize);
+    kernel(search);
+    return takeCompletionResult(search);
+}
+
+/* ---------------- WORKER POOL ---------------- */
+
+// Fixed set of threads shared by all jobs. Higher priority tasks run
+// first; tasks of equal priority run in submission order.
+class WorkerPool
+{
+public:
+    explicit WorkerPool(unsigned threadCount)
+    {
+        for (unsigned i = 0; i < threadCount; i++)
+            workers.emplace_back([this] { workerLoop(); });
+    }
+
+    ~WorkerPool()
+    {
+        {
+            lock_guard<mutex> lock(queueMutex);
+            stopping = true;
+        }
+        queueReady.notify_all();
+        for (thread &worker : workers)
+            worker.join();
+    }
+
+    void submit(int priority, function<void()> run)
+    {
+        {
+            lock_guard<mutex> lock(queueMutex);
+            pending.push({priority, nextSequence++, move(run)});
+        }
+        metrics().queuedTasks.fetch_add(1, memory_order_relaxed);
+        queueReady.notify_one();
+    }
+
+    unsigned size() const { return unsigned(workers.size()); }
+
+private:
+    struct Task
+    {
+        int priority;
+        uint64_t sequence;
+        function<void()> run;
+    };
+
+    struct TaskOrder
+    {
+        bool operator()(const Task &a, const Task &b) const
+        {
+            if (a.priority != b.priority)
+                return a.priority < b.priority;
+            return a.sequence > b.sequence;
+        }
+    };
+
+    void workerLoop()
+    {
+        metrics().claimWorkerSlot();
+        ThreadMetrics &counters = metrics().local();
+        while (true)
+        {
+            Task task;
+            {
+                unique_lock<mutex> lock(queueMutex);
+                queueReady.wait(lock, [this] { return stopping || !pending.empty(); });
+                if (pending.empty())
+                    return;
+                task = pending.top();
+                pending.pop();
+            }
+            metrics().queuedTasks.fetch_sub(1, memory_order_relaxed);
+
+            auto runStart = chrono::steady_clock::now();
+            task.run();
+            counters.tasks.fetch_add(1, memory_order_relaxed);
+            counters.busyNs.fetch_add(chrono::duration_cast<chrono::nanoseconds>(
+                                          chrono::steady_clock::now() - runStart).count(),
+                                      memory_order_relaxed);
+        }
+    }
+
+    vector<thread> workers;
+    priority_queue<Task, vector<Task>, TaskOrder> pending;
+    mutex queueMutex;
+    condition_variable queueReady;
+    uint64_t nextSequence = 0;
+    bool stopping = false;
+};
+
+WorkerPool &sharedWorkerPool()
+{
+    static WorkerPool pool(max(1u, thread::hardware_concurrency()));
+    return pool;
+}
+
+// Runs body(0) .. body(count - 1) on the shared pool and waits for all
+// of them. Must not be called from a pool task.
+void parallelFor(size_t count, int priority, const function<void(size_t)> &body)
+{
+    mutex doneMutex;
+    condition_variable doneSignal;
+    size_t remaining = count;
+
+    WorkerPool &pool = sharedWorkerPool();
+    for (size_t i = 0; i < count; i++)
+        pool.submit(priority, [&, i]
+                    {
+                        body(i);
+                        lock_guard<mutex> lock(doneMutex);
+                        if (--remaining == 0)
+                            doneSignal.notify_all();
+                    });
+
+    unique_lock<mutex> lock(doneMutex);
+    doneSignal.wait(lock, [&] { return remaining == 0; });
+}
+
+/* ---------------- BATCH COMPLETION ---------------- */
+
+// Solves many small instances at once. Instances are grouped by N so each
+// task runs one specialised kernel over a chunk and reuses its buffers;
+// results come back in input order.
+vector<CompletionResult> solveCompletionBatch(const vector<CompletionInstance> &instances,
+                                              long long limit = LLONG_MAX,
+                                              int priority = 0)
+{
+    vector<CompletionResult> results(instances.size());
+
+    vector<size_t> order;
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+        if (isValidInstance(instances[i]))
+            order.push_back(i);
+        else
+            results[i].error = "invalid instance";
+    }
+    stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+                { return instances[a].boardSize < instances[b].boardSize; });
+
+    // Chunks never straddle two board sizes
+    vector<pair<size_t, size_t>> chunks;
+    for (size_t begin = 0; begin < order.size();)
+    {
+        size_t end = begin;
+        int boardSize = instances[order[begin]].boardSize;
+        while (end < order.size() && end - begin < BATCH_CHUNK_SIZE &&
+               instances[order[end]].boardSize == boardSize)
+            end++;
+        chunks.push_back({begin, end});
+        begin = end;
+    }
+
+    parallelFor(chunks.size(), priority, [&](size_t chunk)
+                {
+                    CompletionSearch search;
+                    CompletionKernel kernel =
+                        completionKernelFor(instances[order[chunks[chunk].first]].boardSize);
+
+                    for (size_t i = chunks[chunk].first; i < chunks[chunk].second; i++)
+                    {
+                        prepareCompletion(search, instances[order[i]], limit);
+                        kernel(search);
+                        results[order[i]] = takeCompletionResult(search);
+                    }
+                });
+
+    return results;
+}
+
+// "N c1 .. cN [; r,c r,c ..]": 1-based columns with 0 for a free row,
+// then optional blocked cells as 1-based row,column pairs
+bool parseCompletionInstance(const string &line, CompletionInstance &instance)
+{
+    size_t separator = line.find(';');
+    istringstream queens(line.substr(0, separator));
+
+    instance = CompletionInstance();
+    if (!(queens >> instance.boardSize) || instance.boardSize < 1 || instance.boardSize > 64)
+        return false;
+
+    instance.fixedColumns.assign(instance.boardSize, 0);
+    for (int &col : instance.fixedColumns)
+        if (!(queens >> col))
+            return false;
+
+    string extra;
+    if (queens >> extra)
+        return false;
+
+    if (separator != string::npos)
+    {
+        instance.blocked.assign(instance.boardSize, 0);
+        istringstream cells(line.substr(separator + 1));
+        int row, col;
+        char comma;
+        while (cells >> row >> comma >> col)
+        {
+            if (comma != ',' || row < 1 || row > instance.boardSize ||
+                col < 1 || col > instance.boardSize)
+                return false;
+            instance.blocked[row - 1] |= 1ULL << (col - 1);
+        }
+        if (!cells.eof())
+            return false;
+    }
+
+    return isValidInstance(instance);
+}
+
+/* ---------------- PORTFOLIO SOLVER ---------------- */
+
+// Board symmetry of a cell: bit 0 mirrors the columns, bit 1 flips the
+// rows, bit 2 transposes. Searching a transformed instance visits the
+// columns (or the rows) in another order with the same kernels.
+void transformCell(int &row, int &col, int boardSize, int transform)
+{
+    if (transform & 4)
+        swap(row, col);
+    if (transform & 1)
+        col = boardSize - 1 - col;
+    if (transform & 2)
+        row = boardSize - 1 - row;
+}
+
+void untransformCell(int &row, int &col, int boardSize, int transform)
+{
+    if (transform & 2)
+        row = boardSize - 1 - row;
+    if (transform & 1)
+        col = boardSize - 1 - col;
+    if (transform & 4)
+        swap(row, col);
+}
+
+CompletionInstance transformInstance(const CompletionInstance &instance, int transform)
+{
+    int n = instance.boardSize;
+    CompletionInstance result;
+    result.boardSize = n;
+    result.fixedColumns.assign(n, 0);
+    result.blocked.assign(n, 0);
+
+    for (int row = 0; row < n; row++)
+        for (int col = 0; col < n; col++)
+        {
+            int newRow = row, newCol = col;
+            transformCell(newRow, newCol, n, transform);
+            if (instance.fixedColumns[row] == col + 1)
+            {
+                // Two fixed queens in one column: the transposed row can have none
+                if (result.fixedColumns[newRow])
+                    result.blocked[newRow] = ~0ULL;
+                result.fixedColumns[newRow] = newCol + 1;
+            }
+            if (row < int(instance.blocked.size()) && ((instance.blocked[row] >> col) & 1))
+                result.blocked[newRow] |= 1ULL << newCol;
+        }
+
+    return result;
+}
+
+vector<int> untransformCompletion(const vector<int> &completion, int transform)
+{
+    int n = int(completion.size());
+    vector<int> result(n, 0);
+    for (int row = 0; row < n; row++)
+    {
+        int originalRow = row, originalCol = completion[row] - 1;
+        untransformCell(originalRow, originalCol, n, transform);
+        result[originalRow] = originalCol + 1;
+    }
+    return result;
+}
+
+// Depth-first with a random column order at every node, abandoned after
+// a node budget that doubles on each restart
+struct RestartSearch
+{
+    int boardSize = 0;
+    const vector<uint64_t> *allowed = nullptr;
+    const CancellationToken *cancelToken = nullptr;
+    mt19937_64 random;
+    long long nodes = 0;
+    long long budget = 0;
+    bool stopped = false;   // Out of budget or cancelled
+    vector<int> placement;
+};
+
+bool randomCompletionBacktrack(RestartSearch &search, int row, uint64_t columns,
+                               uint64_t diagLeft, uint64_t diagRight)
+{
+    if (row == search.boardSize)
+        return true;
+
+    if (++search.nodes > search.budget ||
+        ((search.nodes & (PROGRESS_POLL_NODES - 1)) == 0 && search.cancelToken->isCancelled()))
+    {
+        search.stopped = true;
+        return false;
+    }
+
+    int candidates[64];
+    int candidateCount = 0;
+    uint64_t available = ~(columns | diagLeft | diagRight) & (*search.allowed)[row];
+    while (available)
+    {
+        candidates[candidateCount++] = __builtin_ctzll(available);
+        available &= available - 1;
+    }
+    shuffle(candidates, candidates + candidateCount, search.random);
+
+    for (int i = 0; i < candidateCount && !search.stopped; i++)
+    {
+        uint64_t bit = 1ULL << candidates[i];
+        search.placement[row] = candidates[i] + 1;
+        if (randomCompletionBacktrack(search, row + 1, columns | bit,
+                                      (diagLeft | bit) << 1, (diagRight | bit) >> 1))
+            return true;
+    }
+    return false;
+}
+
+// True once there is an answer: a completion, or none when a restart ran
+// to the end of its tree within budget
+bool randomRestartCompletion(const CompletionInstance &instance, const vector<uint64_t> &allowed,
+                             const CancellationToken &cancelToken, uint64_t seed,
+                             vector<int> &completion)
+{
+    RestartSearch search;
+    search.boardSize = instance.boardSize;
+    search.allowed = &allowed;
+    search.cancelToken = &cancelToken;
+    search.random.seed(seed);
+    search.placement.assign(instance.boardSize, 0);
+
+    for (long long budget = PORTFOLIO_RESTART_NODES; !cancelToken.isCancelled(); budget *= 2)
+    {
+        search.nodes = 0;
+        search.budget = budget;
+        search.stopped = false;
+        if (randomCompletionBacktrack(search, 0, 0, 0, 0))
+        {
+            completion = search.placement;
+            return true;
+        }
+        if (!search.stopped)
+        {
+            completion.clear();
+            return true;
+        }
+    }
+    return false;
+}
+
+// Min-conflicts over the free rows. A free row only ever takes an allowed
+// column, and those are never attacked by a fixed queen, so conflicts are
+// between free rows only. Cannot prove that no completion exists.
+bool localSearchCompletion(const CompletionInstance &instance, const vector<uint64_t> &allowed,
+                           const CancellationToken &cancelToken, uint64_t seed,
+                           vector<int> &completion)
+{
+    int n = instance.boardSize;
+    mt19937_64 random(seed);
+    vector<int> columnOf(n), freeRows;
+    vector<int> columnCount(n), sumCount(2 * n - 1), differenceCount(2 * n - 1);
+
+    for (int row = 0; row < n; row++)
+        if (!instance.fixedColumns[row])
+            freeRows.push_back(row);
+
+    auto place = [&](int row, int col, int delta)
+    {
+        columnCount[col] += delta;
+        sumCount[row + col] += delta;
+        differenceCount[row - col + n - 1] += delta;
+    };
+    auto conflicts = [&](int row, int col)
+    {
+        return columnCount[col] + sumCount[row + col] + differenceCount[row - col + n - 1];
+    };
+
+    // The column of the row with the fewest conflicts, ties broken at random
+    auto bestColumn = [&](int row)
+    {
+        int best = -1, bestConflicts = INT_MAX, ties = 0;
+        for (uint64_t open = allowed[row]; open; open &= open - 1)
+        {
+            int col = __builtin_ctzll(open);
+            int count = conflicts(row, col);
+            if (count < bestConflicts)
+            {
+                best = col;
+                bestConflicts = count;
+                ties = 1;
+            }
+            else if (count == bestConflicts && random() % ++ties == 0)
+                best = col;
+        }
+        return best;
+    };
+
+    long long maxSteps = PORTFOLIO_LOCAL_STEPS * n;
+    while (!cancelToken.isCancelled())
+    {
+        fill(columnCount.begin(), columnCount.end(), 0);
+        fill(sumCount.begin(), sumCount.end(), 0);
+        fill(differenceCount.begin(), differenceCount.end(), 0);
+        for (int row = 0; row < n; row++)
+            if (instance.fixedColumns[row])
+            {
+                columnOf[row] = instance.fixedColumns[row] - 1;
+                place(row, columnOf[row], 1);
+            }
+
+        shuffle(freeRows.begin(), freeRows.end(), random);
+        for (int row : freeRows)
+        {
+            columnOf[row] = bestColumn(row);
+            place(row, columnOf[row], 1);
+        }
+
+        vector<int> conflicted;
+        for (long long step = 0; step < maxSteps && !cancelToken.isCancelled(); step++)
+        {
+            conflicted.clear();
+            for (int row : freeRows)
+                if (conflicts(row, columnOf[row]) > 3)
+                    conflicted.push_back(row);
+
+            if (conflicted.empty())
+            {
+                completion.resize(n);
+                for (int row = 0; row < n; row++)
+                    completion[row] = columnOf[row] + 1;
+                return true;
+            }
+
+            int row = conflicted[random() % conflicted.size()];
+            place(row, columnOf[row], -1);
+            columnOf[row] = bestColumn(row);
+            place(row, columnOf[row], 1);
+        }
+    }
+    return false;
+}
+
+struct PortfolioResult
+{
+    vector<int> completion;     // 1-based columns, empty if there is none
+    string strategy;            // The one that answered first
+    string error;               // Set for a malformed instance
+};
+
+// Runs every strategy on its own thread against one shared token. The
+// first answer wins and cancels the rest. Dedicated threads, not the pool:
+// the losers must be running, not queued, for the race to mean anything.
+PortfolioResult solvePortfolio(const CompletionInstance &instance, uint64_t seed = 1)
+{
+    PortfolioResult result;
+    if (!isValidInstance(instance))
+    {
+        result.error = "invalid instance";
+        return result;
+    }
+
+    vector<uint64_t> allowed;
+    computeAllowedColumns(instance, allowed);
+    if (any_of(allowed.begin(), allowed.end(), [](uint64_t open) { return open == 0; }))
+    {
+        result.strategy = "presolve";
+        return result;
+    }
+
+    CancellationToken cancelToken;
+    mutex resultMutex;
+    auto answer = [&](const char *strategy, const vector<int> &completion)
+    {
+        lock_guard<mutex> lock(resultMutex);
+        if (!result.strategy.empty())
+            return;
+        result.strategy = strategy;
+        result.completion = completion;
+        cancelToken.cancel();
+    };
+
+    // Depth-first in four traversal orders, through the fixed-N kernels
+    static const pair<const char *, int> DFS_ORDERS[] = {
+        {"dfs-ascending", 0}, {"dfs-descending", 1}, {"dfs-bottom-up", 2}, {"dfs-transposed", 4}};
+
+    vector<thread> strategies;
+    for (const auto &order : DFS_ORDERS)
+        strategies.emplace_back([&, order]
+                                {
+                                    CompletionResult found = solveCompletion(
+                                        transformInstance(instance, order.second), 1, &cancelToken);
+                                    if (found.solutions > 0)
+                                        answer(order.first, untransformCompletion(found.firstCompletion,
+                                                                                  order.second));
+                                    else if (!cancelToken.isCancelled())
+                                        answer(order.first, {});
+                                });
+
+    strategies.emplace_back([&]
+                            {
+                                vector<int> completion;
+                                if (randomRestartCompletion(instance, allowed, cancelToken, seed, completion))
+                                    answer("random-restarts", completion);
+                            });
+    strategies.emplace_back([&]
+                            {
+                                vector<int> completion;
+                                if (localSearchCompletion(instance, allowed, cancelToken, seed, completion))
+                                    answer("local-search", completion);
+                            });
+
+    for (thread &strategy : strategies)
+        strategy.join();
+    return result;
+}
+
+/* ---------------- JOB API ---------------- */
+
+struct SolveProgress
+{
+    int tasksDone;
+    int tasksTotal;
+    long long solutions;    // Found so far (lags by up to one poll)
+    long long nodes;
+};
+
+using ProgressCallback = function<void(const SolveProgress &)>;
+
+struct SolveResult
+{
+    int boardSize = 0;
+    long long totalSolutions = 0;
+    bool cancelled = false;
+    long long elapsedMs = 0;
+    string error;           // Set when the job could not run
+    Fingerprint fingerprint; // Only with SolveOptions::fingerprint
+    shared_ptr<SolutionVisitor> visitor; // Reduced visitor, with SolveOptions::visitorFactory
+};
+
+struct SolveOptions
+{
+    int boardSize = 0;
+    string outputFile;      // Empty -> count only, nothing is written
+    int priority = 0;       // Higher runs first on the shared pool
+    int invariantRotation = 0; // 90 / 180: only solutions fixed by that rotation
+    long long firstSolutions = 0; // > 0: only the first K in canonical order
+    bool noThreeInLine = false; // Also no three queens on any line
+    OutputFormat outputFormat = OutputFormat::Text;
+    bool fingerprint = false; // Hash every solution into result.fingerprint
+    bool directWrite = false; // Count pass, then pwrite records to their final offsets
+    int splitDepth = 1;       // Rows fixed per task; more rows, more and smaller tasks
+    bool mirrorHalving = true; // Search half the first row, mirror the rest
+
+    // Parallel visitor: one instance per worker from the factory, combined
+    // pairwise by reduce at the end. Not with firstSolutions.
+    VisitorFactory visitorFactory;
+    VisitorReduce visitorReduce;
+
+    ProgressCallback onProgress;
+    chrono::milliseconds progressInterval = DEFAULT_PROGRESS_INTERVAL;
+    CancellationToken cancelToken;
+
+    // Called on a worker once the result is ready, for callers that
+    // cannot wait on the handle
+    function<void(const SolveResult &)> onComplete;
+};
+
+struct JobState
+{
+    SolveOptions options;
+    vector<SearchTask> tasks;
+    vector<FILE *> taskFiles;
+    chrono::steady_clock::time_point startTime;
+
+    // Direct writes: the count pass fills taskSolutions, then every task
+    // writes its records from its own offset of the output file
+    bool countPass = false;
+    vector<long long> taskSolutions;
+    vector<long long> taskOffsets;
+    int outputFd = -1;
+    atomic<bool> writeFailed{false};
+
+    // Visitors not in use by a task; a task takes one or makes a new one
+    mutex visitorMutex;
+    vector<unique_ptr<SolutionVisitor>> idleVisitors;
+
+    atomic<int> tasksRemaining{0};
+    atomic<long long> solutions{0};
+    atomic<long long> nodes{0};
+    atomic<uint64_t> fingerprintSum{0};
+    atomic<long long> lastReportNs{0};
+    mutex progressMutex;
+
+    mutex doneMutex;
+    condition_variable doneSignal;
+    bool done = false;
+    SolveResult result;
+};
+
+void reportProgress(JobState &job, bool force)
+{
+    if (!job.options.onProgress)
+        return;
+
+    long long now = chrono::duration_cast<chrono::nanoseconds>(
+                        chrono::steady_clock::now() - job.startTime).count();
+    long long last = job.lastReportNs.load(memory_order_relaxed);
+    long long interval = chrono::duration_cast<chrono::nanoseconds>(
+                             job.options.progressInterval).count();
+
+    if (!force && (now - last < interval ||
+                   !job.lastReportNs.compare_exchange_strong(last, now)))
+        return;
+
+    // A slow callback must not be re-entered by another worker
+    unique_lock<mutex> lock(job.progressMutex, defer_lock);
+    if (force)
+        lock.lock();
+    else if (!lock.try_lock())
+        return;
+
+    SolveProgress progress;
+    progress.tasksTotal = int(job.tasks.size());
+    progress.tasksDone = progress.tasksTotal - job.tasksRemaining.load();
+    progress.solutions = job.solutions.load(memory_order_relaxed);
+    progress.nodes = job.nodes.load(memory_order_relaxed);
+    job.options.onProgress(progress);
+}
+
+void publishCounts(SearchState &state)
+{
+    JobState &job = *state.job;
+    ThreadMetrics &counters = metrics().local();
+    counters.nodes.fetch_add(state.nodes - state.publishedNodes, memory_order_relaxed);
+    counters.solutions.fetch_add(state.totalSolutions - state.publishedSolutions,
+                                 memory_order_relaxed);
+
+    job.nodes.fetch_add(state.nodes - state.publishedNodes, memory_order_relaxed);
+    long long added = state.totalSolutions - state.publishedSolutions;
+    long long before = job.solutions.fetch_add(added, memory_order_relaxed);
+    if (before / SOLUTION_MILESTONE != (before + added) / SOLUTION_MILESTONE)
+        TRACE_PROBE2(solution__milestone, job.options.boardSize, before + added);
+
+    state.publishedNodes = state.nodes;
+    state.publishedSolutions = state.totalSolutions;
+}
+
+void pollSearch(SearchState &state)
+{
+    if (state.cancelToken && state.cancelToken->isCancelled())
+        state.terminateSearch = true;
+    if (state.cutoffTask &&
+        state.taskIndex > state.cutoffTask->load(memory_order_relaxed))
+        state.terminateSearch = true;
+
+    if (!state.job)
+        return;
+
+    publishCounts(state);
+    reportProgress(*state.job, false);
+}
+
+// Header plus the task outputs in plan order
+void writeJobOutput(JobState &job)
+{
+    ofstream out(job.options.outputFile, ios::binary);
+    writeOutputHeader(out, job.options.outputFormat, job.options.boardSize,
+                      job.result.totalSolutions);
+
+    char copyBuffer[4096];
+    for (FILE *file : job.taskFiles)
+    {
+        rewind(file);
+        size_t bytesRead;
+        while ((bytesRead = fread(copyBuffer, 1, sizeof(copyBuffer), file)) > 0)
+            out.write(copyBuffer, bytesRead);
+    }
+}
+
+void completeJob(JobState &job);
+
+unique_ptr<SolutionVisitor> acquireVisitor(JobState &job)
+{
+    {
+        lock_guard<mutex> lock(job.visitorMutex);
+        if (!job.idleVisitors.empty())
+        {
+            unique_ptr<SolutionVisitor> visitor = move(job.idleVisitors.back());
+            job.idleVisitors.pop_back();
+            return visitor;
+        }
+    }
+    return job.options.visitorFactory();
+}
+
+void releaseVisitor(JobState &job, unique_ptr<SolutionVisitor> visitor)
+{
+    visitor->flush();
+    lock_guard<mutex> lock(job.visitorMutex);
+    job.idleVisitors.push_back(move(visitor));
+}
+
+// All tasks are done, so every instance is idle
+unique_ptr<SolutionVisitor> reduceVisitors(JobState &job)
+{
+    if (job.idleVisitors.empty())
+        return job.options.visitorFactory();
+
+    unique_ptr<SolutionVisitor> result = move(job.idleVisitors[0]);
+    for (size_t i = 1; i < job.idleVisitors.size(); i++)
+        job.options.visitorReduce(*result, *job.idleVisitors[i]);
+    job.idleVisitors.clear();
+    return result;
+}
+
+void finishJob(JobState &job)
+{
+    job.result.boardSize = job.options.boardSize;
+    job.result.totalSolutions = job.solutions.load();
+    job.result.cancelled = job.options.cancelToken.isCancelled();
+    if (job.options.fingerprint)
+        job.result.fingerprint = {job.result.totalSolutions, job.fingerprintSum.load()};
+
+    if (!job.options.outputFile.empty() && !job.result.cancelled &&
+        job.result.error.empty() && job.outputFd < 0)
+        writeJobOutput(job);
+
+    if (job.writeFailed && job.result.error.empty())
+        job.result.error = "Failed to write output file";
+
+    if (job.outputFd >= 0)
+    {
+        close(job.outputFd);
+        job.outputFd = -1;
+
+        // The records were laid out for the full count
+        if (job.result.cancelled || !job.result.error.empty())
+            remove(job.options.outputFile.c_str());
+    }
+
+    for (FILE *file : job.taskFiles)
+        if (file)
+            fclose(file);
+    job.taskFiles.clear();
+
+    if (job.options.visitorFactory && job.result.error.empty())
+        job.result.visitor = reduceVisitors(job);
+
+    completeJob(job);
+}
+
+void completeJob(JobState &job)
+{
+    job.result.elapsedMs = chrono::duration_cast<chrono::milliseconds>(
+                               chrono::steady_clock::now() - job.startTime).count();
+    reportProgress(job, true);
+
+    {
+        lock_guard<mutex> lock(job.doneMutex);
+        job.done = true;
+    }
+    job.doneSignal.notify_all();
+
+    if (job.options.onComplete)
+        job.options.onComplete(job.result);
+}
+
+void runJobTask(const shared_ptr<JobState> &job, size_t taskIndex);
+
+// Lays the output file out from the counts of the first pass: header,
+// then each task's records, every record of a format having one length
+void startWritePass(const shared_ptr<JobState> &job)
+{
+    const SolveOptions &options = job->options;
+    job->countPass = false;
+    if (options.cancelToken.isCancelled())
+    {
+        finishJob(*job);
+        return;
+    }
+
+    long long total = 0;
+    for (long long solutions : job->taskSolutions)
+        total += solutions;
+
+    string header;
+    long long recordSize = 0;
+    withOutputFormat(options.outputFormat, [&](auto policy)
+                     {
+                         typedef decltype(policy) Format;
+                         ostringstream out;
+                         Format::writeHeader(out, options.boardSize, total);
+                         header = out.str();
+
+                         // Any permutation has the length of every solution
+                         int identity[64];
+                         char record[3 * 64 + 1];
+                         for (int row = 0; row < options.boardSize; row++)
+                             identity[row] = row + 1;
+                         recordSize = Format::template format<false>(
+                                          record, identity, max(1, options.boardSize)) -
+                                      record;
+                     });
+
+    long long offset = (long long)header.size();
+    for (size_t i = 0; i < job->tasks.size(); i++)
+    {
+        job->taskOffsets.push_back(offset);
+        offset += job->taskSolutions[i] * recordSize;
+    }
+
+    job->outputFd = open(options.outputFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (job->outputFd < 0 ||
+        pwrite(job->outputFd, header.data(), header.size(), 0) != ssize_t(header.size()) ||
+        ftruncate(job->outputFd, offset) != 0)
+    {
+        job->result.error = "Failed to create output file";
+        finishJob(*job);
+        return;
+    }
+
+    // The writing pass counts the solutions again
+    job->solutions = 0;
+    job->tasksRemaining = int(job->tasks.size());
+
+    WorkerPool &pool = sharedWorkerPool();
+    for (size_t i = 0; i < job->tasks.size(); i++)
+        pool.submit(options.priority, [job, i] { runJobTask(job, i); });
+}
+
+void runJobTask(const shared_ptr<JobState> &job, size_t taskIndex)
+{
+    if (!job->options.cancelToken.isCancelled())
+    {
+        auto state = make_unique<SearchState>();
+        state->boardSize = job->options.boardSize;
+        state->fullMask = columnMask(state->boardSize);
+        state->cancelToken = &job->options.cancelToken;
+        state->job = job.get();
+        state->solutionTempFile = job->taskFiles[taskIndex];
+        state->outputFormat = job->options.outputFormat;
+        state->computeFingerprint = job->options.fingerprint && !job->countPass;
+        state->taskIndex = (long long)taskIndex;
+        if (!job->countPass && job->outputFd >= 0)
+        {
+            state->outputFd = job->outputFd;
+            state->outputOffset = job->taskOffsets[taskIndex];
+        }
+
+        unique_ptr<SolutionVisitor> visitor;
+        if (job->options.visitorFactory && !job->countPass)
+            visitor = acquireVisitor(*job);
+        state->visitor = visitor.get();
+
+        TRACE_PROBE2(task__start, state->boardSize, state->taskIndex);
+        runSearchTask(*state, job->tasks[taskIndex]);
+        flushOutput(*state);
+        if (state->writeFailed)
+            job->writeFailed = true;
+        publishCounts(*state);
+        TRACE_PROBE3(task__finish, state->taskIndex, state->totalSolutions, state->nodes);
+        job->fingerprintSum.fetch_add(state->fingerprintSum);
+        job->taskSolutions[taskIndex] = state->totalSolutions;
+        if (visitor)
+            releaseVisitor(*job, move(visitor));
+    }
+
+    // The last task to finish assembles the result
+    if (job->tasksRemaining.fetch_sub(1) == 1)
+    {
+        if (job->countPass)
+            startWritePass(job);
+        else
+            finishJob(*job);
+    }
+}
+
+// Handle to a submitted job. get() blocks until the result is ready;
+// the job itself runs entirely on the shared worker pool.
+class JobHandle
+{
+public:
+    explicit JobHandle(shared_ptr<JobState> state) : state(move(state)) {}
+
+    bool ready() const
+    {
+        lock_guard<mutex> lock(state->doneMutex);
+        return state->done;
+    }
+
+    bool waitFor(chrono::milliseconds timeout) const
+    {
+        unique_lock<mutex> lock(state->doneMutex);
+        return state->doneSignal.wait_for(lock, timeout, [this] { return state->done; });
+    }
+
+    SolveResult get() const
+    {
+        unique_lock<mutex> lock(state->doneMutex);
+        state->doneSignal.wait(lock, [this] { return state->done; });
+        return state->result;
+    }
+
+    void cancel() const { state->options.cancelToken.cancel(); }
+
+private:
+    shared_ptr<JobState> state;
+};
+
+/* ---------------- FIRST K SOLUTIONS ---------------- */
+
+// Yields the valid placements of the first `depth` rows in
+// lexicographic (canonical) order.
+class PrefixGenerator
+{
+public:
+    PrefixGenerator(int boardSize, int depth)
+        : depth(depth), fullMask(columnMask(boardSize)),
+          columns(depth + 1), diagLeft(depth + 1), diagRight(depth + 1),
+          available(depth + 1), prefix(depth)
+    {
+        available[0] = fullMask;
+    }
+
+    bool next(vector<int> &out)
+    {
+        while (level >= 0)
+        {
+            if (!available[level])
+            {
+                level--;
+                continue;
+            }
+
+            uint64_t bit = available[level] & -available[level];
+            available[level] -= bit;
+            prefix[level] = __builtin_ctzll(bit);
+
+            if (level + 1 == depth)
+            {
+                out = prefix;
+                return true;
+            }
+
+            columns[level + 1] = columns[level] | bit;
+            diagLeft[level + 1] = (diagLeft[level] | bit) << 1;
+            diagRight[level + 1] = (diagRight[level] | bit) >> 1;
+            available[level + 1] =
+                ~(columns[level + 1] | diagLeft[level + 1] | diagRight[level + 1]) & fullMask;
+            level++;
+        }
+        return false;
+    }
+
+private:
+    int depth;
+    int level = 0;
+    uint64_t fullMask;
+    vector<uint64_t> columns, diagLeft, diagRight, available;
+    vector<int> prefix;
+};
+
+struct FirstKSlot
+{
+    string text;            // Solutions of one prefix, in canonical order
+    long long solutions = 0;
+    bool done = false;
+};
+
+// Prefixes are handed out in canonical order and searched speculatively
+// by every worker. Finished slots are committed from the front; once the
+// committed ones hold K solutions, later prefixes are cut off.
+struct FirstKState
+{
+    long long k = 0;
+    PrefixGenerator prefixes;
+
+    mutex slotMutex;
+    deque<FirstKSlot> slots;        // Indexed by prefix number
+    size_t commitCursor = 0;        // Slots before it are done and committed
+    long long committedSolutions = 0;
+    atomic<long long> cutoffTask{LLONG_MAX};
+    atomic<int> workersRemaining{0};
+
+    FirstKState(int boardSize, int depth, long long k)
+        : k(k), prefixes(boardSize, depth) {}
+};
+
+void finishFirstKJob(JobState &job, FirstKState &search)
+{
+    job.result.boardSize = job.options.boardSize;
+    job.result.totalSolutions = min(search.k, search.committedSolutions);
+    job.result.cancelled = job.options.cancelToken.isCancelled();
+    if (job.result.cancelled)
+    {
+        completeJob(job);
+        return;
+    }
+
+    ofstream out;
+    if (!job.options.outputFile.empty())
+    {
+        out.open(job.options.outputFile, ios::binary);
+        writeOutputHeader(out, job.options.outputFormat, job.options.boardSize,
+                          job.result.totalSolutions);
+    }
+
+    long long remaining = job.result.totalSolutions;
+    for (size_t i = 0; i < search.commitCursor && remaining > 0; i++)
+    {
+        const FirstKSlot &slot = search.slots[i];
+        size_t length = slot.text.size();
+
+        // Records of one N all have the same size in every format
+        if (slot.solutions > remaining)
+            length = length / slot.solutions * remaining;
+        remaining -= min(slot.solutions, remaining);
+
+        if (out.is_open())
+            out.write(slot.text.data(), length);
+
+        // At most K records: hash them back from the buffer
+        if (job.options.fingerprint)
+        {
+            istringstream records(slot.text.substr(0, length));
+            vector<int> placement;
+            while (readRecord(records, job.options.outputFormat,
+                              job.options.boardSize, placement))
+                job.result.fingerprint.hashSum +=
+                    solutionHash<false>(placement.data(), job.options.boardSize);
+        }
+    }
+    if (job.options.fingerprint)
+        job.result.fingerprint.solutions = job.result.totalSolutions;
+
+    completeJob(job);
+}
+
+void runFirstKWorker(const shared_ptr<JobState> &job,
+                     const shared_ptr<FirstKState> &search)
+{
+    vector<int> prefix;
+    while (!job->options.cancelToken.isCancelled())
+    {
+        long long index, limit;
+        {
+            lock_guard<mutex> lock(search->slotMutex);
+            if (search->cutoffTask.load() != LLONG_MAX || !search->prefixes.next(prefix))
+                break;
+
+            index = (long long)search->slots.size();
+            search->slots.emplace_back();
+
+            // A single prefix never has to contribute more than this
+            limit = search->k - search->committedSolutions;
+        }
+
+        string text;
+        auto state = make_unique<SearchState>();
+        state->boardSize = job->options.boardSize;
+        state->fullMask = columnMask(state->boardSize);
+        state->solutionLimit = limit;
+        state->cancelToken = &job->options.cancelToken;
+        state->cutoffTask = &search->cutoffTask;
+        state->taskIndex = index;
+        state->job = job.get();
+        state->outputFormat = job->options.outputFormat;
+        if (!job->options.outputFile.empty() || job->options.fingerprint)
+            state->memoryOutput = &text;
+
+        TRACE_PROBE2(task__start, state->boardSize, state->taskIndex);
+        runSearchTask(*state, {prefix, false, 0});
+        flushOutput(*state);
+        publishCounts(*state);
+        TRACE_PROBE3(task__finish, state->taskIndex, state->totalSolutions, state->nodes);
+
+        lock_guard<mutex> lock(search->slotMutex);
+        if (index > search->cutoffTask.load())
+            continue;
+
+        FirstKSlot &slot = search->slots[index];
+        slot.text = move(text);
+        slot.solutions = state->totalSolutions;
+        slot.done = true;
+
+        while (search->commitCursor < search->slots.size() &&
+               search->slots[search->commitCursor].done &&
+               search->committedSolutions < search->k)
+        {
+            search->committedSolutions += search->slots[search->commitCursor].solutions;
+            search->commitCursor++;
+        }
+
+        if (search->committedSolutions >= search->k)
+        {
+            search->cutoffTask = (long long)search->commitCursor - 1;
+
+            // Speculative results past the cut are never needed
+            for (size_t i = search->commitCursor; i < search->slots.size(); i++)
+                string().swap(search->slots[i].text);
+        }
+    }
+
+    if (search->workersRemaining.fetch_sub(1) == 1)
+        finishFirstKJob(*job, *search);
+}
+
+// Deep enough that the front of the canonical order is split finely
+int firstKSplitDepth(int boardSize)
+{
+    return min(boardSize, max(2, boardSize / 3));
+}
+
+JobHandle submitFirstKJob(const SolveOptions &options)
+{
+    auto job = make_shared<JobState>();
+    job->options = options;
+    job->startTime = chrono::steady_clock::now();
+
+    int depth = firstKSplitDepth(options.boardSize);
+    auto search = make_shared<FirstKState>(options.boardSize, depth,
+                                           options.firstSolutions);
+
+    WorkerPool &pool = sharedWorkerPool();
+    search->workersRemaining = int(pool.size());
+    for (unsigned i = 0; i < pool.size(); i++)
+        pool.submit(options.priority, [job, search] { runFirstKWorker(job, search); });
+
+    return JobHandle(job);
+}
+
+JobHandle submitJob(const SolveOptions &options)
+{
+    // The first-K search knows neither the rotation nor the line constraint
+    bool constrained = options.invariantRotation || options.noThreeInLine;
+    if (options.firstSolutions > 0 && !options.visitorFactory && !constrained)
+        return submitFirstKJob(options);
+
+    auto job = make_shared<JobState>();
+    job->options = options;
+    job->tasks = planSearchTasks(options.boardSize, options.invariantRotation,
+                                 options.noThreeInLine, options.mirrorHalving);
+    if (options.splitDepth > 1)
+        job->tasks = splitSearchTasks(job->tasks, options.boardSize, options.splitDepth);
+    job->startTime = chrono::steady_clock::now();
+    job->tasksRemaining = int(job->tasks.size());
+    job->taskSolutions.assign(job->tasks.size(), 0);
+    job->countPass = options.directWrite && !options.outputFile.empty();
+
+    job->taskFiles.assign(job->tasks.size(), nullptr);
+    if (!options.outputFile.empty() && !job->countPass)
+        for (FILE *&file : job->taskFiles)
+            if (!(file = tmpfile()))
+                job->result.error = "Failed to create temp file";
+
+    // Speculative first-K tasks would show the visitor extra solutions
+    if (options.visitorFactory && (!options.visitorReduce || options.firstSolutions > 0))
+        job->result.error = "A visitor needs a reduce and cannot be used with first K";
+    if (options.firstSolutions > 0 && constrained)
+        job->result.error = "First K cannot be combined with a rotation or the line constraint";
+
+    if (job->tasks.empty() || !job->result.error.empty())
+    {
+        finishJob(*job);
+        return JobHandle(job);
+    }
+
+    WorkerPool &pool = sharedWorkerPool();
+    for (size_t i = 0; i < job->tasks.size(); i++)
+        pool.submit(options.priority, [job, i] { runJobTask(job, i); });
+
+    return JobHandle(job);
+}
+
+/* ---------------- PLUGINS ---------------- */
+
+// A visitor library loaded with dlopen, see nqueens_plugin.h. Shared by
+// its visitors, which may outlive the job that made them.
+struct Plugin
+{
+    void *library = nullptr;
+    const nqueens_plugin_api *api = nullptr;
+    string args;
+
+    ~Plugin()
+    {
+        if (library)
+            dlclose(library);
+    }
+};
+
+bool loadPlugin(const string &path, Plugin &plugin, string &error)
+{
+    plugin.library = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!plugin.library)
+    {
+        error = dlerror();
+        return false;
+    }
+
+    auto entry = reinterpret_cast<nqueens_plugin_entry_fn>(
+        dlsym(plugin.library, NQUEENS_PLUGIN_ENTRY));
+    plugin.api = entry ? entry() : nullptr;
+    if (!plugin.api || plugin.api->abi_version != NQUEENS_PLUGIN_ABI_VERSION)
+    {
+        error = path + ": not a plugin of ABI version " + to_string(NQUEENS_PLUGIN_ABI_VERSION);
+        return false;
+    }
+    return true;
+}
+
+// One plugin instance per visitor. Solutions are collected into blocks, so
+// the plugin costs one indirect call per PLUGIN_BATCH_SOLUTIONS of them.
+class PluginVisitor : public SolutionVisitor
+{
+public:
+    PluginVisitor(const shared_ptr<const Plugin> &plugin, int boardSize)
+        : plugin(plugin), api(plugin->api), boardSize(boardSize),
+          state(plugin->api->create(boardSize, plugin->args.c_str()))
+    {
+        batch.reserve(PLUGIN_BATCH_SOLUTIONS * boardSize);
+    }
+
+    PluginVisitor(const PluginVisitor &) = delete;
+    PluginVisitor &operator=(const PluginVisitor &) = delete;
+
+    ~PluginVisitor() override { api->destroy(state); }
+
+    void visit(const int *placement, int) override
+    {
+        batch.insert(batch.end(), placement, placement + boardSize);
+        if (batch.size() >= PLUGIN_BATCH_SOLUTIONS * boardSize)
+            flush();
+    }
+
+    void flush() override
+    {
+        if (batch.empty())
+            return;
+        api->consume(state, batch.data(), batch.size() / boardSize, boardSize);
+        batch.clear();
+    }
+
+    void mergeFrom(PluginVisitor &other)
+    {
+        flush();
+        other.flush();
+        api->merge(state, other.state);
+    }
+
+    void finish(long long totalSolutions)
+    {
+        flush();
+        api->finish(state, totalSolutions);
+    }
+
+private:
+    shared_ptr<const Plugin> plugin;
+    const nqueens_plugin_api *api;
+    size_t boardSize;
+    void *state;
+    vector<int32_t> batch;
+};
+
+// The plugin replaces the output file
+void attachPlugin(SolveOptions &options, const shared_ptr<const Plugin> &plugin)
+{
+    int boardSize = options.boardSize;
+    options.outputFile.clear();
+    options.visitorFactory = [plugin, boardSize]
+    { return unique_ptr<SolutionVisitor>(new PluginVisitor(plugin, boardSize)); };
+    options.visitorReduce = [](SolutionVisitor &into, SolutionVisitor &from)
+    { static_cast<PluginVisitor &>(into).mergeFrom(static_cast<PluginVisitor &>(from)); };
+}
+
+/* ---------------- PLANNER ---------------- */
+
+enum class PlanMode
+{
+    Count,      // Number of solutions only
+    Enumerate,  // Every solution to the output backend
+    First       // The first K in canonical order
+};
+
+struct PlanRequest
+{
+    int boardSize = 0;
+    PlanMode mode = PlanMode::Enumerate;
+    long long firstSolutions = 0;
+    int invariantRotation = 0;
+    bool noThreeInLine = false;
+    OutputFormat outputFormat = OutputFormat::Text;
+    bool plugin = false;            // A plugin takes the solutions
+    bool forceDirectWrite = false;  // Asked for on the command line
+    bool cachedCount = false;       // A result cache already holds the count
+};
+
+struct ExecutionPlan
+{
+    string engine;                  // Follows from the request
+    string symmetry;
+    bool mirrorHalving = true;
+    int splitDepth = 1;
+    size_t taskCount = 0;
+    string output;
+    bool directWrite = false;
+    bool fromCache = false;         // Answered by the result cache, nothing to run
+    double estimatedNodes = 0;
+    double estimatedSeconds = 0;
+    bool calibrated = false;        // Rates measured here, not the defaults
+    vector<string> reasons;
+};
+
+// Published solution counts (OEIS A000170), used to size the work
+const double KNOWN_SOLUTION_COUNTS[] = {
+    1, 1, 0, 0, 2, 10, 4, 40, 92, 352, 724, 2680, 14200, 73712, 365596, 2279184,
+    14772512, 95815104, 666090624, 4968057848.0, 39029188884.0, 314666222712.0,
+    2691008701644.0, 24233937684440.0, 227514171973736.0, 2207893435808352.0,
+    22317699616364044.0, 234907967154122528.0};
+
+double estimatedSolutionCount(int boardSize)
+{
+    int known = int(sizeof(KNOWN_SOLUTION_COUNTS) / sizeof(KNOWN_SOLUTION_COUNTS[0])) - 1;
+    if (boardSize < 1)
+        return 0;
+    double solutions = KNOWN_SOLUTION_COUNTS[min(boardSize, known)];
+
+    // Past the table the count grows by roughly 0.39 N per row
+    for (int n = known + 1; n <= boardSize; n++)
+        solutions *= 0.39 * n;
+    return solutions;
+}
+
+// Search nodes per second, nodes per solution, and the extra time a
+// solution costs when it is written out
+struct CostModel
+{
+    double nodeRate = PLAN_DEFAULT_NODE_RATE;
+    double nodesPerSolution = PLAN_DEFAULT_NODES_PER_SOLUTION;
+    double secondsPerRecord = PLAN_DEFAULT_SECONDS_PER_RECORD;
+    bool calibrated = false;
+};
+
+// Times the mirrored kernel on one thread at PLAN_CALIBRATION_N, counting
+// and then formatting into memory. Done once, and only for plans whose
+// default estimate is long enough for the measurement not to matter.
+const CostModel &calibratedCostModel()
+{
+    static const CostModel model = []
+    {
+        CostModel measured;
+        auto state = make_unique<SearchState>();
+        state->boardSize = PLAN_CALIBRATION_N;
+        state->fullMask = columnMask(PLAN_CALIBRATION_N);
+
+        auto start = chrono::steady_clock::now();
+        for (const SearchTask &task : planSearchTasks(PLAN_CALIBRATION_N))
+            runSearchTask(*state, task);
+        double countSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        string records;
+        auto writing = make_unique<SearchState>();
+        writing->boardSize = PLAN_CALIBRATION_N;
+        writing->fullMask = state->fullMask;
+        writing->memoryOutput = &records;
+
+        start = chrono::steady_clock::now();
+        for (const SearchTask &task : planSearchTasks(PLAN_CALIBRATION_N))
+            runSearchTask(*writing, task);
+        flushOutput(*writing);
+        double writeSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        if (countSeconds > 0 && state->totalSolutions > 0)
+        {
+            measured.nodeRate = double(state->nodes) / countSeconds;
+            measured.nodesPerSolution = double(state->nodes) / double(state->totalSolutions);
+            measured.secondsPerRecord =
+                max(0.0, writeSeconds - countSeconds) / double(state->totalSolutions);
+            measured.calibrated = true;
+        }
+        return measured;
+    }();
+    return model;
+}
+
+string formatSeconds(double seconds)
+{
+    char text[32];
+    if (seconds < 1)
+        snprintf(text, sizeof(text), "%.3g ms", seconds * 1000);
+    else
+        snprintf(text, sizeof(text), "%.3g s", seconds);
+    return text;
+}
+
+// Names the engine the request calls for and whether it mirrors (fixed by
+// N and the output, never by the machine), then chooses split depth and
+// output backend from a cost estimate: solutions from the known counts,
+// nodes and time from the cost model, spread over the worker pool.
+ExecutionPlan planExecution(const PlanRequest &request)
+{
+    ExecutionPlan plan;
+    int n = request.boardSize;
+    unsigned threads = sharedWorkerPool().size();
+    auto why = [&](const string &reason) { plan.reasons.push_back(reason); };
+
+    if (request.mode == PlanMode::Count && request.cachedCount)
+    {
+        plan.engine = "count cache";
+        plan.fromCache = true;
+        plan.symmetry = "none";
+        plan.output = "none";
+        why("the count of N = " + to_string(n) + " is already cached");
+        return plan;
+    }
+
+    double solutions = estimatedSolutionCount(n);
+    CostModel model;
+    double nodes = solutions * model.nodesPerSolution;
+    auto estimateSeconds = [&]
+    {
+        double seconds = nodes / (model.nodeRate * threads);
+        if (request.mode != PlanMode::Count)
+            seconds += min(solutions, request.mode == PlanMode::First
+                                          ? double(request.firstSolutions) : solutions) *
+                       model.secondsPerRecord / threads;
+        return seconds;
+    };
+    if (estimateSeconds() >= PLAN_CALIBRATION_SECONDS)
+    {
+        model = calibratedCostModel();
+        nodes = solutions * model.nodesPerSolution;
+    }
+    plan.calibrated = model.calibrated;
+
+    // Engine and symmetry
+    if (request.mode == PlanMode::First)
+    {
+        plan.engine = "first-k prefix search";
+        plan.symmetry = "none";
+        plan.splitDepth = firstKSplitDepth(n);
+        nodes = min(nodes, double(request.firstSolutions) * model.nodesPerSolution * 2);
+        why("first K needs canonical order, which mirror pairs would break");
+        why("prefixes of " + to_string(plan.splitDepth) + " rows are searched speculatively, "
+            "committed in order");
+    }
+    else if (request.invariantRotation)
+    {
+        plan.engine = "rotation orbit search";
+        plan.symmetry = "rotation " + to_string(request.invariantRotation) + " + mirror";
+        nodes = pow(nodes, request.invariantRotation == 90 ? 0.25 : 0.5);
+        why("only rotation-invariant solutions are wanted, so whole orbits are placed at once");
+    }
+    else if (request.noThreeInLine)
+    {
+        plan.engine = "no-three-in-line search";
+        plan.symmetry = "mirror";
+        why("the line constraint needs the per-pair line masks; reflection keeps lines, "
+            "so this engine always halves the first row");
+    }
+    else
+    {
+        plan.engine = "bitmask backtracking";
+        plan.symmetry = "mirror";
+        if (request.mode == PlanMode::Enumerate && !request.plugin && n >= ENUMERATION_LIMIT)
+        {
+            plan.symmetry = "none";
+            plan.mirrorHalving = false;
+            nodes *= 2;
+            why("N >= " + to_string(ENUMERATION_LIMIT) + " writes in canonical order, so the "
+                "whole first row is searched and a stopped run leaves a prefix of it");
+        }
+        else
+            why("every solution's mirror image is a solution, so half the first row suffices");
+    }
+    plan.estimatedNodes = nodes;
+    plan.estimatedSeconds = estimateSeconds();
+
+    // Split depth: enough tasks to keep every worker busy to the end, but
+    // small jobs stay whole since a task costs more than it saves
+    if (request.mode != PlanMode::First)
+    {
+        vector<SearchTask> tasks = planSearchTasks(n, request.invariantRotation,
+                                                   request.noThreeInLine, plan.mirrorHalving);
+        size_t wanted = size_t(PLAN_TASKS_PER_THREAD) * threads;
+        if (request.invariantRotation)
+            why("orbit tasks cannot be split below the first row");
+        else if (plan.estimatedSeconds < PLAN_SPLIT_SECONDS)
+            why("estimated " + formatSeconds(plan.estimatedSeconds) +
+                ": too short to gain from smaller tasks");
+        else
+        {
+            while (tasks.size() < wanted && plan.splitDepth < PLAN_MAX_SPLIT_DEPTH &&
+                   plan.splitDepth < n)
+                tasks = splitSearchTasks(tasks, n, ++plan.splitDepth);
+            why("split at depth " + to_string(plan.splitDepth) + " for " + to_string(tasks.size()) +
+                " tasks on " + to_string(threads) + " thread(s), aiming at " + to_string(wanted));
+        }
+        plan.taskCount = tasks.size();
+    }
+
+    // Output backend
+    if (request.mode == PlanMode::Count)
+        plan.output = "none";
+    else if (request.plugin)
+    {
+        plan.output = "plugin, one instance per worker";
+        why("a plugin replaces the output file");
+    }
+    else if (request.mode == PlanMode::First)
+        plan.output = "in-memory slots, written in order";
+    else
+    {
+        double recordBytes = withOutputFormat(request.outputFormat, [&](auto policy)
+                                              { return double(decltype(policy)::maxRecordSize(n)); });
+        double mergeSeconds = solutions * recordBytes / PLAN_MERGE_BYTES_PER_SECOND;
+        double countPassSeconds = nodes / (model.nodeRate * threads);
+
+        plan.directWrite = request.forceDirectWrite || countPassSeconds < mergeSeconds;
+        plan.output = plan.directWrite ? "direct pwrite at computed offsets"
+                                       : "temp file per task, merged in order";
+        if (request.forceDirectWrite)
+            why("direct writes were asked for");
+        else
+            why("merging costs about " + formatSeconds(mergeSeconds) + ", a count pass about " +
+                formatSeconds(countPassSeconds));
+    }
+    return plan;
+}
+
+string summarizePlan(const ExecutionPlan &plan)
+{
+    return plan.engine + ", symmetry " + plan.symmetry + ", split depth " +
+           to_string(plan.splitDepth) + ", output " + plan.output;
+}
+
+string explainPlan(const ExecutionPlan &plan)
+{
+    char estimate[128];
+    snprintf(estimate, sizeof(estimate), "%.3g nodes, %s (%s rates)", plan.estimatedNodes,
+             formatSeconds(plan.estimatedSeconds).c_str(),
+             plan.calibrated ? "measured" : "default");
+
+    string text = "Engine      = " + plan.engine + " (set by the request)\n" +
+                  "Symmetry    = " + plan.symmetry + "\n" +
+                  "Split depth = " + to_string(plan.splitDepth) +
+                  (plan.taskCount ? " (" + to_string(plan.taskCount) + " tasks)" : "") + "\n" +
+                  "Output      = " + plan.output + "\n" +
+                  "Estimate    = " + estimate + "\n";
+    for (const string &reason : plan.reasons)
+        text += "  - " + reason + "\n";
+    return text;
+}
+
+/* ---------------- UNIQUE SOLUTIONS (BURNSIDE) ---------------- */
+
+struct UniqueCount
+{
+    long long totalSolutions = 0;
+    long long fixedBy90 = 0;        // Invariant under a quarter turn
+    long long fixedBy180 = 0;       // Invariant under a half turn
+    long long uniqueSolutions = 0;
+};
+
+// Burnside's lemma over the 8 board symmetries. For N > 1 no reflection
+// fixes a solution, and the 90 and 270 degree turns fix the same ones, so
+// unique = (total + 2 * fixed90 + fixed180) / 8.
+UniqueCount countUniqueSolutions(int boardSize, int priority = 0)
+{
+    SolveOptions options;
+    options.boardSize = boardSize;
+    options.priority = priority;
+    JobHandle totalJob = submitJob(options);
+
+    options.invariantRotation = 90;
+    JobHandle quarterJob = submitJob(options);
+
+    options.invariantRotation = 180;
+    JobHandle halfJob = submitJob(options);
+
+    UniqueCount count;
+    count.totalSolutions = totalJob.get().totalSolutions;
+    count.fixedBy90 = quarterJob.get().totalSolutions;
+    count.fixedBy180 = halfJob.get().totalSolutions;
+
+    if (boardSize == 1)
+        count.uniqueSolutions = 1;
+    else
+        count.uniqueSolutions =
+            (count.totalSolutions + 2 * count.fixedBy90 + count.fixedBy180) / 8;
+
+    return count;
+}
+
+/* ---------------- PUZZLE GENERATOR ---------------- */
+
+// Depth-first search trying columns in random order; gives up once the
+// node budget is spent so the caller can restart with a new order.
+bool randomBacktrack(int boardSize, mt19937_64 &rng, int row, uint64_t columns,
+                     uint64_t diagLeft, uint64_t diagRight,
+                     vector<int> &placement, long long &budget)
+{
+    if (row == boardSize)
+        return true;
+    if (--budget < 0)
+        return false;
+
+    uint64_t available = ~(columns | diagLeft | diagRight) & columnMask(boardSize);
+    int candidates[64];
+    int count = 0;
+    while (available)
+    {
+        candidates[count++] = __builtin_ctzll(available);
+        available &= available - 1;
+    }
+    shuffle(candidates, candidates + count, rng);
+
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t bit = 1ULL << candidates[i];
+        placement[row] = candidates[i] + 1;
+        if (randomBacktrack(boardSize, rng, row + 1,
+                            columns | bit,
+                            (diagLeft | bit) << 1,
+                            (diagRight | bit) >> 1,
+                            placement, budget))
+            return true;
+    }
+    return false;
+}
+
+vector<int> randomSolution(int boardSize, mt19937_64 &rng)
+{
+    vector<int> placement(boardSize, 0);
+    for (long long limit = 16LL * boardSize * boardSize;; limit *= 2)
+    {
+        long long budget = limit;
+        if (randomBacktrack(boardSize, rng, 0, 0, 0, 0, placement, budget))
+            return placement;
+    }
+}
+
+// Removes queens of a random solution in random order, keeping a removal
+// only while the remaining clues still have exactly one completion
+vector<int> makePuzzle(int boardSize, uint64_t seed)
+{
+    mt19937_64 rng(seed);
+
+    CompletionInstance instance;
+    instance.boardSize = boardSize;
+    instance.fixedColumns = randomSolution(boardSize, rng);
+
+    vector<int> rows(boardSize);
+    for (int i = 0; i < boardSize; i++)
+        rows[i] = i;
+    shuffle(rows.begin(), rows.end(), rng);
+
+    for (int row : rows)
+    {
+        int clue = instance.fixedColumns[row];
+        instance.fixedColumns[row] = 0;
+
+        // Two completions are enough to know it is not unique
+        if (solveCompletion(instance, 2).solutions != 1)
+            instance.fixedColumns[row] = clue;
+    }
+    return instance.fixedColumns;
+}
+
+// Puzzle i depends only on (seed, i), whatever the thread count
+vector<vector<int>> generatePuzzles(int boardSize, size_t count, uint64_t seed)
+{
+    vector<vector<int>> puzzles(count);
+    parallelFor(count, 0, [&](size_t i)
+                { puzzles[i] = makePuzzle(boardSize, mix64(seed + i)); });
+    return puzzles;
+}
+
+/* ---------------- MAXIMUM WEIGHT PLACEMENT ---------------- */
+
+struct WeightedBoard
+{
+    int boardSize = 0;
+    vector<long long> weights;              // Row-major N x N
+    vector<vector<int>> columnsByWeight;    // Per row, heaviest column first
+    vector<long long> columnSuffixMax;      // [row * N + col]: heaviest in rows >= row
+
+    long long weight(int row, int col) const { return weights[row * boardSize + col]; }
+};
+
+void sortColumnsByWeight(WeightedBoard &board)
+{
+    board.columnsByWeight.assign(board.boardSize, vector<int>(board.boardSize));
+    for (int row = 0; row < board.boardSize; row++)
+    {
+        vector<int> &order = board.columnsByWeight[row];
+        for (int col = 0; col < board.boardSize; col++)
+            order[col] = col;
+        stable_sort(order.begin(), order.end(), [&](int a, int b)
+                    { return board.weight(row, a) > board.weight(row, b); });
+    }
+
+    int n = board.boardSize;
+    board.columnSuffixMax.assign(size_t(n + 1) * n, LLONG_MIN);
+    for (int row = n - 1; row >= 0; row--)
+        for (int col = 0; col < n; col++)
+            board.columnSuffixMax[row * n + col] =
+                max(board.columnSuffixMax[(row + 1) * n + col], board.weight(row, col));
+}
+
+struct WeightProgress
+{
+    long long incumbent;    // Best weight found, LLONG_MIN before the first
+    long long upperBound;   // No placement can weigh more
+    double gap;             // (upperBound - incumbent) / |upperBound|
+    long long nodes;
+};
+
+struct WeightResult
+{
+    long long bestWeight = LLONG_MIN;
+    vector<int> placement;  // 1-based columns, empty if there is none
+    long long upperBound = LLONG_MIN;   // Equals bestWeight once optimal
+    bool optimal = false;   // False if cancelled before the proof
+    long long nodes = 0;
+};
+
+// Shared by all tasks of one run; the incumbent is read lock-free on
+// every bound test and only written under bestMutex
+struct WeightSearch
+{
+    const WeightedBoard &board;
+    uint64_t fullMask;
+    const CancellationToken &cancelToken;
+
+    atomic<long long> incumbent{LLONG_MIN};
+    atomic<long long> nodes{0};
+    mutex bestMutex;
+    vector<int> best;
+
+    WeightSearch(const WeightedBoard &board, const CancellationToken &cancelToken)
+        : board(board), fullMask(columnMask(board.boardSize)), cancelToken(cancelToken) {}
+};
+
+struct WeightTask
+{
+    WeightSearch &search;
+    vector<int> placement;
+    long long nodes = 0;
+    bool stopped = false;
+};
+
+// The smaller of two bounds on the remaining weight: per remaining row the
+// heaviest cell no placed queen attacks, and per free column its heaviest
+// cell in the remaining rows. LLONG_MIN if some row has no open cell.
+long long remainingWeightBound(const WeightSearch &search, int row, uint64_t columns,
+                               uint64_t diagLeft, uint64_t diagRight)
+{
+    int n = search.board.boardSize;
+    long long columnBound = 0;
+    for (uint64_t free = ~columns & search.fullMask; free; free &= free - 1)
+        columnBound += search.board.columnSuffixMax[row * n + __builtin_ctzll(free)];
+
+    long long bound = 0;
+    for (int next = row; next < search.board.boardSize; next++)
+    {
+        uint64_t open = ~(columns | diagLeft | diagRight) & search.fullMask;
+        if (!open)
+            return LLONG_MIN;
+
+        for (int col : search.board.columnsByWeight[next])
+            if ((open >> col) & 1)
+            {
+                bound += search.board.weight(next, col);
+                break;
+            }
+
+        diagLeft <<= 1;
+        diagRight >>= 1;
+    }
+    return min(bound, columnBound);
+}
+
+void offerIncumbent(WeightSearch &search, long long weight, const vector<int> &placement)
+{
+    lock_guard<mutex> lock(search.bestMutex);
+    if (weight <= search.incumbent.load())
+        return;
+    search.best = placement;
+    search.incumbent.store(weight);
+}
+
+// Heaviest columns first, so good incumbents turn up early and tighten
+// the pruning for every other task
+void weightBacktrack(WeightTask &task, int row, uint64_t columns, uint64_t diagLeft,
+                     uint64_t diagRight, long long weight)
+{
+    WeightSearch &search = task.search;
+    if ((++task.nodes & (PROGRESS_POLL_NODES - 1)) == 0)
+    {
+        search.nodes.fetch_add(PROGRESS_POLL_NODES, memory_order_relaxed);
+        metrics().local().nodes.fetch_add(PROGRESS_POLL_NODES, memory_order_relaxed);
+        if (search.cancelToken.isCancelled())
+            task.stopped = true;
+    }
+    if (task.stopped)
+        return;
+
+    if (row == search.board.boardSize)
+    {
+        offerIncumbent(search, weight, task.placement);
+        return;
+    }
+
+    long long bound = remainingWeightBound(search, row, columns, diagLeft, diagRight);
+    if (bound == LLONG_MIN || weight + bound <= search.incumbent.load(memory_order_relaxed))
+        return;
+
+    uint64_t available = ~(columns | diagLeft | diagRight) & search.fullMask;
+    for (int col : search.board.columnsByWeight[row])
+    {
+        if (!((available >> col) & 1))
+            continue;
+
+        uint64_t bit = 1ULL << col;
+        task.placement[row] = col + 1;
+        weightBacktrack(task, row + 1,
+                        columns | bit,
+                        (diagLeft | bit) << 1,
+                        (diagRight | bit) >> 1,
+                        weight + search.board.weight(row, col));
+    }
+}
+
+// Splits on the first rows, searches the most promising prefixes first
+// and reports the optimality gap every progressInterval. Blocks; must not
+// be called from a pool task.
+WeightResult maximizeWeight(const WeightedBoard &board, const CancellationToken &cancelToken,
+                            const function<void(const WeightProgress &)> &onProgress,
+                            chrono::milliseconds progressInterval = chrono::milliseconds(1000))
+{
+    int n = board.boardSize;
+    WeightSearch search(board, cancelToken);
+
+    struct Prefix
+    {
+        vector<int> columns;
+        long long bound;
+    };
+    vector<Prefix> prefixes;
+
+    vector<int> prefix;
+    PrefixGenerator generator(n, min(n, 2));
+    while (generator.next(prefix))
+    {
+        uint64_t columns = 0, diagLeft = 0, diagRight = 0;
+        long long weight = 0;
+        for (int row = 0; row < int(prefix.size()); row++)
+        {
+            uint64_t bit = 1ULL << prefix[row];
+            columns |= bit;
+            diagLeft = (diagLeft | bit) << 1;
+            diagRight = (diagRight | bit) >> 1;
+            weight += board.weight(row, prefix[row]);
+        }
+
+        long long rest = remainingWeightBound(search, int(prefix.size()), columns, diagLeft, diagRight);
+        if (rest != LLONG_MIN)
+            prefixes.push_back({prefix, weight + rest});
+    }
+    stable_sort(prefixes.begin(), prefixes.end(), [](const Prefix &a, const Prefix &b)
+                { return a.bound > b.bound; });
+
+    mutex doneMutex;
+    condition_variable doneSignal;
+    size_t remaining = prefixes.size();
+
+    // Per prefix, the best weight its unsearched subtrees could still
+    // reach: LLONG_MIN once it is exhausted, unchanged if it was cancelled
+    vector<atomic<long long>> openBounds(prefixes.size());
+    for (size_t i = 0; i < prefixes.size(); i++)
+        openBounds[i].store(prefixes[i].bound);
+
+    WorkerPool &pool = sharedWorkerPool();
+    for (size_t i = 0; i < prefixes.size(); i++)
+        pool.submit(0, [&, i]
+                    {
+                        const Prefix &start = prefixes[i];
+                        if (start.bound <= search.incumbent.load())
+                            openBounds[i].store(LLONG_MIN);
+                        else if (!cancelToken.isCancelled())
+                        {
+                            WeightTask task{search, vector<int>(n, 0)};
+                            int row = int(start.columns.size());
+                            uint64_t columns = 0, diagLeft = 0, diagRight = 0;
+                            long long weight = 0;
+                            for (int r = 0; r < row; r++)
+                            {
+                                uint64_t bit = 1ULL << start.columns[r];
+                                task.placement[r] = start.columns[r] + 1;
+                                columns |= bit;
+                                diagLeft = (diagLeft | bit) << 1;
+                                diagRight = (diagRight | bit) >> 1;
+                                weight += board.weight(r, start.columns[r]);
+                            }
+
+                            if (row == n)
+                                weightBacktrack(task, row, columns, diagLeft, diagRight, weight);
+                            else
+                            {
+                                // One child subtree at a time, so the prefix's bound
+                                // drops to its best unsearched child as each finishes
+                                struct Child
+                                {
+                                    int col;
+                                    long long bound;
+                                };
+                                vector<Child> children;
+                                uint64_t available = ~(columns | diagLeft | diagRight) & search.fullMask;
+                                for (int col : board.columnsByWeight[row])
+                                {
+                                    if (!((available >> col) & 1))
+                                        continue;
+                                    uint64_t bit = 1ULL << col;
+                                    long long rest = remainingWeightBound(search, row + 1, columns | bit,
+                                                                          (diagLeft | bit) << 1,
+                                                                          (diagRight | bit) >> 1);
+                                    if (rest != LLONG_MIN)
+                                        children.push_back({col, weight + board.weight(row, col) + rest});
+                                }
+
+                                vector<long long> laterBound(children.size() + 1, LLONG_MIN);
+                                for (size_t c = children.size(); c-- > 0;)
+                                    laterBound[c] = max(laterBound[c + 1], children[c].bound);
+                                openBounds[i].store(laterBound[0]);
+
+                                for (size_t c = 0; c < children.size() && !task.stopped; c++)
+                                {
+                                    int col = children[c].col;
+                                    if (children[c].bound > search.incumbent.load(memory_order_relaxed))
+                                    {
+                                        uint64_t bit = 1ULL << col;
+                                        task.placement[row] = col + 1;
+                                        weightBacktrack(task, row + 1,
+                                                        columns | bit,
+                                                        (diagLeft | bit) << 1,
+                                                        (diagRight | bit) >> 1,
+                                                        weight + board.weight(row, col));
+                                    }
+                                    if (!task.stopped)
+                                        openBounds[i].store(laterBound[c + 1]);
+                                }
+                            }
+                            search.nodes.fetch_add(task.nodes % PROGRESS_POLL_NODES,
+                                                   memory_order_relaxed);
+                            metrics().local().nodes.fetch_add(task.nodes % PROGRESS_POLL_NODES,
+                                                              memory_order_relaxed);
+                            if (!task.stopped)
+                                openBounds[i].store(LLONG_MIN);
+                        }
+
+                        lock_guard<mutex> lock(doneMutex);
+                        if (--remaining == 0)
+                            doneSignal.notify_all();
+                    });
+
+    // Unsearched subtrees still bound the optimum; searched ones are exact
+    auto upperBound = [&]
+    {
+        long long bound = search.incumbent.load();
+        for (const atomic<long long> &open : openBounds)
+            bound = max(bound, open.load());
+        return bound;
+    };
+
+    unique_lock<mutex> lock(doneMutex);
+    while (!doneSignal.wait_for(lock, progressInterval, [&] { return remaining == 0; }))
+    {
+        if (!onProgress)
+            continue;
+
+        WeightProgress progress;
+        progress.incumbent = search.incumbent.load();
+        progress.upperBound = upperBound();
+        progress.gap = progress.incumbent == LLONG_MIN ? 1.0
+                       : progress.upperBound == 0 ? 0.0
+                       : double(progress.upperBound - progress.incumbent) /
+                             double(llabs(progress.upperBound));
+        progress.nodes = search.nodes.load();
+        onProgress(progress);
+    }
+
+    WeightResult result;
+    result.bestWeight = search.incumbent.load();
+    result.placement = search.best;
+    result.upperBound = upperBound();
+    result.optimal = result.upperBound == result.bestWeight;
+    result.nodes = search.nodes.load();
+    return result;
+}
+
+// "N" then N rows of N integer weights
+bool readWeightedBoard(const string &path, WeightedBoard &board)
+{
+    ifstream input(path);
+    if (!input || !(input >> board.boardSize) || board.boardSize < 1 ||
+        board.boardSize > MAX_BOARD_SIZE)
+        return false;
+
+    board.weights.assign(size_t(board.boardSize) * board.boardSize, 0);
+    for (long long &weight : board.weights)
+        if (!(input >> weight))
+            return false;
+
+    sortColumnsByWeight(board);
+    return true;
+}
+
+/* ---------------- WARM SNAPSHOT ---------------- */
+
+// A server's finished counts and subtree cache, saved to a file that a
+// restarted server maps instead of rebuilding them. Layout, in host
+// byte order with every section 8-byte aligned:
+//   SnapshotHeader
+//   SnapshotCount[countEntries]            sorted by board size
+//   SnapshotIndexEntry[subtreeEntries]     sorted by key hash
+//   per subtree: SnapshotRecord, the key's row masks, int32_t first completion
+const char SNAPSHOT_MAGIC[8] = {'N', 'Q', 'W', 'A', 'R', 'M', '\0', '\0'};
+const uint32_t SNAPSHOT_VERSION = 2;
+const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+
+// Boards a snapshot's keys can describe: residual keys hold one uint64_t
+// column mask per row
+const uint32_t SNAPSHOT_MIN_BOARD_SIZE = 1;
+const uint32_t SNAPSHOT_MAX_BOARD_SIZE = 64;
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t minBoardSize;
+    uint32_t maxBoardSize;
+    uint64_t fileSize;
+    uint64_t countEntries;
+    uint64_t countOffset;
+    uint64_t subtreeEntries;
+    uint64_t indexOffset;
+};
+
+struct SnapshotCount
+{
+    int64_t boardSize;
+    int64_t solutions;
+};
+
+struct SnapshotIndexEntry
+{
+    uint64_t keyHash;
+    uint64_t offset;
+};
+
+struct SnapshotRecord
+{
+    uint32_t keyLength;
+    uint32_t completionLength;
+    int64_t solutions;
+    int64_t cost;
+};
+
+// FNV-1a: unlike std::hash, the same in every build
+uint64_t snapshotKeyHash(const ResidualKey &key)
+{
+    const char *data = reinterpret_cast<const char *>(key.masks.data());
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < sizeof(uint64_t) * size_t(key.rows); i++)
+        hash = (hash ^ uint8_t(data[i])) * 1099511628211ULL;
+    return hash;
+}
+
+// Only keys of the lookup band are ever stored
+bool readSnapshotKey(const char *data, uint32_t length, ResidualKey &key)
+{
+    if (length % sizeof(uint64_t) != 0 || int(length / sizeof(uint64_t)) < CACHE_MIN_ROWS ||
+        int(length / sizeof(uint64_t)) > CACHE_MAX_ROWS)
+        return false;
+    key = ResidualKey();
+    key.rows = int(length / sizeof(uint64_t));
+    memcpy(key.masks.data(), data, length);
+    return true;
+}
+
+// A snapshot file mapped read only. Opening checks the header and the
+// section bounds; the sections themselves are only read by lookups, so
+// their pages come in as they are needed.
+class WarmSnapshot
+{
+public:
+    WarmSnapshot() = default;
+    WarmSnapshot(const WarmSnapshot &) = delete;
+    WarmSnapshot &operator=(const WarmSnapshot &) = delete;
+
+    ~WarmSnapshot()
+    {
+        if (base)
+            munmap(const_cast<char *>(base), size);
+    }
+
+    bool open(const string &path, string &error)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            error = "no snapshot at " + path;
+            return false;
+        }
+
+        struct stat status;
+        void *mapped = MAP_FAILED;
+        if (fstat(fd, &status) == 0 && size_t(status.st_size) >= sizeof(SnapshotHeader))
+            mapped = mmap(nullptr, size_t(status.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        else
+            error = path + " is not a snapshot";
+        close(fd);
+        if (mapped == MAP_FAILED)
+        {
+            if (error.empty())
+                error = "cannot map " + path;
+            return false;
+        }
+        base = static_cast<const char *>(mapped);
+        size = size_t(status.st_size);
+
+        const SnapshotHeader &header = *reinterpret_cast<const SnapshotHeader *>(base);
+        if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+            error = path + " is not a snapshot";
+        else if (header.version != SNAPSHOT_VERSION || header.byteOrder != SNAPSHOT_BYTE_ORDER)
+            error = "snapshot version " + to_string(header.version) + " does not match " +
+                    to_string(SNAPSHOT_VERSION);
+        else if (header.minBoardSize != SNAPSHOT_MIN_BOARD_SIZE ||
+                 header.maxBoardSize != SNAPSHOT_MAX_BOARD_SIZE)
+            error = "snapshot covers N = " + to_string(header.minBoardSize) + ".." +
+                    to_string(header.maxBoardSize) + ", not " +
+                    to_string(SNAPSHOT_MIN_BOARD_SIZE) + ".." + to_string(SNAPSHOT_MAX_BOARD_SIZE);
+        else if (header.fileSize != size ||
+                 !fits(header.countOffset, header.countEntries, sizeof(SnapshotCount)) ||
+                 !fits(header.indexOffset, header.subtreeEntries, sizeof(SnapshotIndexEntry)))
+            error = "snapshot " + path + " is truncated";
+        if (!error.empty())
+        {
+            munmap(const_cast<char *>(base), size);
+            base = nullptr;
+            return false;
+        }
+
+        counts = reinterpret_cast<const SnapshotCount *>(base + header.countOffset);
+        countEntries = size_t(header.countEntries);
+        index = reinterpret_cast<const SnapshotIndexEntry *>(base + header.indexOffset);
+        subtreeEntries = size_t(header.subtreeEntries);
+        return true;
+    }
+
+    bool isOpen() const { return base != nullptr; }
+    size_t countSize() const { return countEntries; }
+    size_t subtreeSize() const { return subtreeEntries; }
+
+    bool findCount(int boardSize, long long &solutions) const
+    {
+        const SnapshotCount *end = counts + countEntries;
+        const SnapshotCount *found = lower_bound(counts, end, boardSize,
+                                                 [](const SnapshotCount &count, int n)
+                                                 { return count.boardSize < n; });
+        if (found == end || found->boardSize != boardSize)
+            return false;
+        solutions = found->solutions;
+        return true;
+    }
+
+    bool findSubtree(const ResidualKey &key, SubtreeValue &value, long long &cost) const
+    {
+        uint64_t keyHash = snapshotKeyHash(key);
+        const SnapshotIndexEntry *end = index + subtreeEntries;
+        const SnapshotIndexEntry *entry = lower_bound(index, end, keyHash,
+                                                      [](const SnapshotIndexEntry &candidate, uint64_t hash)
+                                                      { return candidate.keyHash < hash; });
+        for (; entry != end && entry->keyHash == keyHash; entry++)
+        {
+            const char *keyData;
+            const SnapshotRecord *record = recordAt(entry->offset, keyData);
+            ResidualKey stored;
+            if (record && readSnapshotKey(keyData, record->keyLength, stored) && stored == key)
+            {
+                readValue(*record, keyData, value, cost);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Calls visit(count) for every count
+    template <typename Visit>
+    void forEachCount(Visit visit) const
+    {
+        for (size_t i = 0; i < countEntries; i++)
+            visit(counts[i]);
+    }
+
+    // Calls visit(key, value, cost) for every subtree
+    template <typename Visit>
+    void forEachSubtree(Visit visit) const
+    {
+        for (size_t i = 0; i < subtreeEntries; i++)
+        {
+            const char *keyData;
+            const SnapshotRecord *record = recordAt(index[i].offset, keyData);
+            ResidualKey key;
+            if (!record || !readSnapshotKey(keyData, record->keyLength, key))
+                continue;
+
+            SubtreeValue value;
+            long long cost;
+            readValue(*record, keyData, value, cost);
+            visit(key, value, cost);
+        }
+    }
+
+private:
+    bool fits(uint64_t offset, uint64_t count, size_t itemSize) const
+    {
+        return offset % 8 == 0 && offset <= size && count <= (size - offset) / itemSize;
+    }
+
+    // Null for a record that runs past the end of the file
+    const SnapshotRecord *recordAt(uint64_t offset, const char *&keyData) const
+    {
+        if (!fits(offset, 1, sizeof(SnapshotRecord)))
+            return nullptr;
+        const SnapshotRecord *record = reinterpret_cast<const SnapshotRecord *>(base + offset);
+        uint64_t bytes = uint64_t(record->keyLength) + uint64_t(record->completionLength) * 4;
+        if (bytes > size - offset - sizeof(SnapshotRecord))
+            return nullptr;
+        keyData = base + offset + sizeof(SnapshotRecord);
+        return record;
+    }
+
+    static void readValue(const SnapshotRecord &record, const char *keyData,
+                          SubtreeValue &value, long long &cost)
+    {
+        value.solutions = record.solutions;
+        value.firstCompletion.resize(record.completionLength);
+        for (uint32_t i = 0; i < record.completionLength; i++)
+        {
+            int32_t col;
+            memcpy(&col, keyData + record.keyLength + 4 * i, sizeof(col));
+            value.firstCompletion[i] = col;
+        }
+        cost = record.cost;
+    }
+
+    const char *base = nullptr;
+    size_t size = 0;
+    const SnapshotCount *counts = nullptr;
+    size_t countEntries = 0;
+    const SnapshotIndexEntry *index = nullptr;
+    size_t subtreeEntries = 0;
+};
+
+struct SnapshotTotals
+{
+    long long counts = 0;
+    long long subtrees = 0;
+    long long bytes = 0;
+};
+
+// Writes the counts and every live cache entry, then fills the cache's
+// capacity with the costliest entries of the previous snapshot that were
+// never asked for. Written beside the target and renamed, so a reader
+// never maps half a file and an existing mapping stays valid.
+bool writeWarmSnapshot(const string &path, const map<int, long long> &counts,
+                       const SubtreeCache &cache, const WarmSnapshot &previous,
+                       SnapshotTotals &totals, string &error)
+{
+    map<int, long long> allCounts = counts;
+    previous.forEachCount([&](const SnapshotCount &count)
+                          { allCounts.emplace(int(count.boardSize), count.solutions); });
+
+    struct Subtree
+    {
+        ResidualKey key;
+        SubtreeValue value;
+        long long cost;
+    };
+    vector<Subtree> subtrees;
+    unordered_set<ResidualKey, ResidualKeyHash> liveKeys;
+    cache.forEach([&](const ResidualKey &key, const SubtreeValue &value, long long cost)
+                  {
+                      subtrees.push_back({key, value, cost});
+                      liveKeys.insert(key);
+                  });
+
+    vector<Subtree> earlier;
+    previous.forEachSubtree([&](const ResidualKey &key, const SubtreeValue &value, long long cost)
+                            {
+                                if (!liveKeys.count(key))
+                                    earlier.push_back({key, value, cost});
+                            });
+    sort(earlier.begin(), earlier.end(),
+         [](const Subtree &a, const Subtree &b) { return a.cost > b.cost; });
+    for (Subtree &subtree : earlier)
+    {
+        if (subtrees.size() >= cache.capacity())
+            break;
+        subtrees.push_back(move(subtree));
+    }
+
+    auto aligned = [](uint64_t offset) { return (offset + 7) & ~uint64_t(7); };
+    auto keyBytes = [](const ResidualKey &key) { return sizeof(uint64_t) * size_t(key.rows); };
+
+    SnapshotHeader header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = SNAPSHOT_BYTE_ORDER;
+    header.minBoardSize = SNAPSHOT_MIN_BOARD_SIZE;
+    header.maxBoardSize = SNAPSHOT_MAX_BOARD_SIZE;
+    header.countEntries = allCounts.size();
+    header.countOffset = sizeof(SnapshotHeader);
+    header.subtreeEntries = subtrees.size();
+    header.indexOffset = header.countOffset + allCounts.size() * sizeof(SnapshotCount);
+
+    vector<SnapshotIndexEntry> index;
+    uint64_t offset = header.indexOffset + subtrees.size() * sizeof(SnapshotIndexEntry);
+    for (const Subtree &subtree : subtrees)
+    {
+        index.push_back({snapshotKeyHash(subtree.key), offset});
+        offset = aligned(offset + sizeof(SnapshotRecord) + keyBytes(subtree.key) +
+                         4 * subtree.value.firstCompletion.size());
+    }
+    header.fileSize = offset;
+
+    string temporary = path + ".tmp";
+    {
+        ofstream out(temporary, ios::binary);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        for (const auto &count : allCounts)
+        {
+            SnapshotCount entry = {count.first, count.second};
+            out.write(reinterpret_cast<const char *>(&entry), sizeof(entry));
+        }
+
+        // Records stay in write order; only the index is sorted
+        vector<SnapshotIndexEntry> sortedIndex = index;
+        sort(sortedIndex.begin(), sortedIndex.end(),
+             [](const SnapshotIndexEntry &a, const SnapshotIndexEntry &b)
+             { return a.keyHash < b.keyHash; });
+        out.write(reinterpret_cast<const char *>(sortedIndex.data()),
+                  streamsize(sortedIndex.size() * sizeof(SnapshotIndexEntry)));
+
+        const char padding[8] = {};
+        for (size_t i = 0; i < subtrees.size(); i++)
+        {
+            const Subtree &subtree = subtrees[i];
+            SnapshotRecord record = {uint32_t(keyBytes(subtree.key)),
+                                     uint32_t(subtree.value.firstCompletion.size()),
+                                     subtree.value.solutions, subtree.cost};
+            out.write(reinterpret_cast<const char *>(&record), sizeof(record));
+            out.write(reinterpret_cast<const char *>(subtree.key.masks.data()),
+                      streamsize(keyBytes(subtree.key)));
+            for (int col : subtree.value.firstCompletion)
+            {
+                int32_t stored = col;
+                out.write(reinterpret_cast<const char *>(&stored), sizeof(stored));
+            }
+            uint64_t end = i + 1 < subtrees.size() ? index[i + 1].offset : header.fileSize;
+            uint64_t written = index[i].offset + sizeof(record) + keyBytes(subtree.key) +
+                               4 * subtree.value.firstCompletion.size();
+            out.write(padding, streamsize(end - written));
+        }
+
+        if (!out)
+        {
+            error = "cannot write " + temporary;
+            return false;
+        }
+    }
+    if (rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        error = "cannot replace " + path;
+        return false;
+    }
+
+    totals.counts = (long long)allCounts.size();
+    totals.subtrees = (long long)subtrees.size();
+    totals.bytes = (long long)header.fileSize;
+    return true;
+}
+
+/* ---------------- SERVER MODE ---------------- */
+
+// State shared by every request of one server process
+struct ServerContext
+{
+    explicit ServerContext(size_t cacheEntries) : cache(cacheEntries) {}
+
+    SubtreeCache cache;
+
+    // Finished "count N" results
+    mutex countMutex;
+    map<int, long long> counts;
+
+    // State saved by an earlier server, if any, and where to save ours
+    WarmSnapshot snapshot;
+    string snapshotPath;
+    mutex snapshotMutex;
+};
+
+// Maps the snapshot at `path` behind the counts and the cache. Call before
+// the first request; on failure the server starts cold.
+bool loadWarmState(ServerContext &server, const string &path, string &error)
+{
+    server.snapshotPath = path;
+    if (!server.snapshot.open(path, error))
+        return false;
+
+    const WarmSnapshot &snapshot = server.snapshot;
+    server.cache.setFallback([&snapshot](const ResidualKey &key, SubtreeValue &value, long long &cost)
+                             { return snapshot.findSubtree(key, value, cost); });
+    return true;
+}
+
+bool saveWarmState(ServerContext &server, SnapshotTotals &totals, string &error)
+{
+    map<int, long long> counts;
+    {
+        lock_guard<mutex> lock(server.countMutex);
+        counts = server.counts;
+    }
+
+    lock_guard<mutex> lock(server.snapshotMutex);
+    return writeWarmSnapshot(server.snapshotPath, counts, server.cache, server.snapshot,
+                             totals, error);
+}
+
+using ServerResponder = function<void(const string &)>;
+
+// One request per line:
+//   count N                                    -> ok <solutions>
+//   complete [limit=L] N c1 .. cN [; r,c ..]   -> ok <count> [c1 .. cN]
+//   stats                                      -> ok entries=.. hit_rate=..
+//   snapshot                                   -> ok counts=.. subtrees=.. bytes=..
+// The work runs on the shared pool and respond() is called from there,
+// so the caller never blocks.
+void handleServerRequest(ServerContext &server, const string &line,
+                         const ServerResponder &respond)
+{
+    istringstream request(line);
+    string command;
+    request >> command;
+
+    if (command == "count")
+    {
+        SolveOptions options;
+        if (!(request >> options.boardSize) || options.boardSize < 1 ||
+            options.boardSize > MAX_BOARD_SIZE)
+        {
+            respond("error invalid board size");
+            return;
+        }
+
+        PlanRequest planRequest;
+        planRequest.boardSize = options.boardSize;
+        planRequest.mode = PlanMode::Count;
+        long long cachedCount = 0;
+        {
+            lock_guard<mutex> lock(server.countMutex);
+            auto cached = server.counts.find(options.boardSize);
+            if (cached != server.counts.end())
+            {
+                planRequest.cachedCount = true;
+                cachedCount = cached->second;
+            }
+            else if (server.snapshot.isOpen())
+                planRequest.cachedCount = server.snapshot.findCount(options.boardSize, cachedCount);
+        }
+
+        ExecutionPlan plan = planExecution(planRequest);
+        if (plan.fromCache)
+        {
+            respond("ok " + to_string(cachedCount));
+            return;
+        }
+        options.splitDepth = plan.splitDepth;
+        options.onComplete = [&server, respond](const SolveResult &result)
+        {
+            if (!result.cancelled)
+            {
+                lock_guard<mutex> lock(server.countMutex);
+                server.counts[result.boardSize] = result.totalSolutions;
+            }
+            respond("ok " + to_string(result.totalSolutions));
+        };
+        submitJob(options);
+    }
+    else if (command == "complete")
+    {
+        long long limit = LLONG_MAX;
+        string rest;
+        getline(request, rest);
+        if (rest.find("limit=") != string::npos)
+        {
+            size_t start = rest.find("limit=");
+            size_t end = rest.find(' ', start);
+            limit = atoll(rest.c_str() + start + 6);
+            rest.erase(start, end == string::npos ? string::npos : end - start);
+        }
+
+        CompletionInstance instance;
+        if (limit <= 0 || !parseCompletionInstance(rest, instance))
+        {
+            respond("error invalid instance");
+            return;
+        }
+
+        SubtreeCache *cache = server.cache.enabled() ? &server.cache : nullptr;
+        sharedWorkerPool().submit(0, [cache, instance, limit, respond]
+                                  {
+                                      CompletionResult result =
+                                          solveCompletion(instance, limit, nullptr, cache);
+                                      string reply = "ok " + to_string(result.solutions);
+                                      for (int col : result.firstCompletion)
+                                          reply += " " + to_string(col);
+                                      respond(reply);
+                                  });
+    }
+    else if (command == "stats")
+    {
+        CacheStats stats = server.cache.stats();
+        char reply[256];
+        snprintf(reply, sizeof(reply),
+                 "ok entries=%lld lookups=%lld hits=%lld hit_rate=%.4f warm_hits=%lld "
+                 "inserts=%lld evictions=%lld",
+                 stats.entries, stats.lookups, stats.hits,
+                 stats.lookups ? double(stats.hits) / double(stats.lookups) : 0.0,
+                 stats.warmHits, stats.inserts, stats.evictions);
+        respond(reply);
+    }
+    else if (command == "snapshot")
+    {
+        if (server.snapshotPath.empty())
+        {
+            respond("error no snapshot file");
+            return;
+        }
+
+        sharedWorkerPool().submit(0, [&server, respond]
+                                  {
+                                      SnapshotTotals totals;
+                                      string error;
+                                      if (!saveWarmState(server, totals, error))
+                                      {
+                                          respond("error " + error);
+                                          return;
+                                      }
+                                      respond("ok counts=" + to_string(totals.counts) +
+                                              " subtrees=" + to_string(totals.subtrees) +
+                                              " bytes=" + to_string(totals.bytes));
+                                  });
+    }
+    else
+        respond("error unknown request");
+}
+
+/* ---------------- LOAD GENERATOR ---------------- */
+
+// Latencies in microseconds, kept HDR style: values below 2 * SUB_BUCKETS
+// are exact, and every power of two above is cut into SUB_BUCKETS
+// linear buckets, so a percentile is off by less than 1 / SUB_BUCKETS
+class LatencyHistogram
+{
+public:
+    LatencyHistogram() : buckets(bucketIndex(LLONG_MAX) + 1, 0) {}
+
+    void record(long long micros)
+    {
+        micros = max(micros, 0LL);
+        buckets[bucketIndex(micros)]++;
+        total++;
+        largest = max(largest, micros);
+    }
+
+    // Highest value of the bucket holding the q-th fraction of the samples
+    long long percentile(double q) const
+    {
+        if (total == 0)
+            return 0;
+        long long rank = max(1LL, (long long)ceil(q * double(total)));
+        long long seen = 0;
+        for (size_t index = 0; index < buckets.size(); index++)
+        {
+            seen += buckets[index];
+            if (seen >= rank)
+                return min(bucketTop(index), largest);
+        }
+        return largest;
+    }
+
+    long long count() const { return total; }
+    long long maximum() const { return largest; }
+
+private:
+    static const int SUB_BUCKET_BITS = 6;
+    static const long long SUB_BUCKETS = 1LL << SUB_BUCKET_BITS;
+
+    static size_t bucketIndex(long long value)
+    {
+        if (value < 2 * SUB_BUCKETS)
+            return size_t(value);
+        int shift = (63 - __builtin_clzll(uint64_t(value))) - SUB_BUCKET_BITS;
+        return size_t(2 * SUB_BUCKETS + (shift - 1) * SUB_BUCKETS +
+                      ((value >> shift) - SUB_BUCKETS));
+    }
+
+    static long long bucketTop(size_t index)
+    {
+        if (index < size_t(2 * SUB_BUCKETS))
+            return (long long)index;
+        long long offset = (long long)index - 2 * SUB_BUCKETS;
+        int shift = int(offset / SUB_BUCKETS) + 1;
+        long long top = SUB_BUCKETS + offset % SUB_BUCKETS;
+        return ((top + 1) << shift) - 1;
+    }
+
+    vector<long long> buckets;
+    long long total = 0;
+    long long largest = 0;
+};
+
+// One line of a load mix: how often it is picked, relative to the others
+struct LoadRequest
+{
+    double weight = 0;
+    string request;
+};
+
+// Mix file lines are "<weight> <server request>", e.g. "10 count 8";
+// empty lines and lines starting with # are skipped
+bool readLoadMix(const string &path, vector<LoadRequest> &mix, string &error)
+{
+    ifstream input(path);
+    if (!input)
+    {
+        error = "Invalid input file";
+        return false;
+    }
+
+    string line;
+    for (int lineNumber = 1; getline(input, line); lineNumber++)
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        istringstream fields(line);
+        LoadRequest entry;
+        if (!(fields >> entry.weight) || entry.weight <= 0)
+        {
+            error = "Invalid weight on line " + to_string(lineNumber);
+            return false;
+        }
+        fields >> ws;
+        getline(fields, entry.request);
+        if (entry.request.empty())
+        {
+            error = "Missing request on line " + to_string(lineNumber);
+            return false;
+        }
+        mix.push_back(entry);
+    }
+
+    if (mix.empty())
+        error = "Empty request mix";
+    return !mix.empty();
+}
+
+struct LoadReport
+{
+    long long sent = 0;
+    long long errors = 0;
+    double seconds = 0;             // First send to last response
+    LatencyHistogram overall;
+    map<string, LatencyHistogram> byCommand;
+};
+
+// Open loop: request i is due at start + i / rate whatever happened to the
+// earlier ones, and its latency runs from that due time, so a stalled
+// server shows up in the tail instead of quietly slowing the generator.
+LoadReport runLoad(ServerContext &server, const vector<LoadRequest> &mix,
+                   double rate, double seconds, uint64_t seed)
+{
+    typedef chrono::steady_clock Clock;
+
+    vector<double> weights;
+    for (const LoadRequest &entry : mix)
+        weights.push_back(entry.weight);
+    discrete_distribution<size_t> pick(weights.begin(), weights.end());
+    mt19937_64 rng(seed);
+
+    LoadReport report;
+    mutex reportMutex;
+    condition_variable idle;
+    long long pending = 0;
+
+    long long total = max(1LL, (long long)llround(rate * seconds));
+    auto start = Clock::now();
+    for (long long i = 0; i < total; i++)
+    {
+        auto due = start + chrono::duration_cast<Clock::duration>(
+                               chrono::duration<double>(double(i) / rate));
+        this_thread::sleep_until(due);
+
+        const string &request = mix[pick(rng)].request;
+        string command = request.substr(0, request.find(' '));
+        {
+            lock_guard<mutex> lock(reportMutex);
+            pending++;
+            report.sent++;
+        }
+
+        handleServerRequest(server, request, [&, due, command](const string &response)
+                            {
+                                long long micros = chrono::duration_cast<chrono::microseconds>(
+                                                       Clock::now() - due).count();
+                                lock_guard<mutex> lock(reportMutex);
+                                report.overall.record(micros);
+                                report.byCommand[command].record(micros);
+                                if (response.rfind("error", 0) == 0)
+                                    report.errors++;
+                                if (--pending == 0)
+                                    idle.notify_all();
+                            });
+    }
+
+    unique_lock<mutex> lock(reportMutex);
+    idle.wait(lock, [&] { return pending == 0; });
+    report.seconds = chrono::duration<double>(Clock::now() - start).count();
+    return report;
+}
+
+string formatLatency(const LatencyHistogram &histogram)
+{
+    char text[160];
+    snprintf(text, sizeof(text), "p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms",
+             histogram.percentile(0.5) / 1000.0, histogram.percentile(0.99) / 1000.0,
+             histogram.percentile(0.999) / 1000.0, histogram.maximum() / 1000.0);
+    return text;
+}
+
+/* ---------------- METRICS EXPORT ---------------- */
+
+// Totals at one point in time, kept by each exporter to turn the
+// counters into rates
+struct MetricsSnapshot
+{
+    chrono::steady_clock::time_point time;
+    long long nodes = 0;
+    long long solutions = 0;
+    vector<long long> busyNs;
+};
+
+MetricsSnapshot takeMetricsSnapshot()
+{
+    MetricsRegistry &registry = metrics();
+    MetricsSnapshot snapshot;
+    snapshot.time = chrono::steady_clock::now();
+    for (int i = 0; i < registry.workerCount(); i++)
+    {
+        snapshot.nodes += registry.worker(i).nodes.load(memory_order_relaxed);
+        snapshot.solutions += registry.worker(i).solutions.load(memory_order_relaxed);
+        snapshot.busyNs.push_back(registry.worker(i).busyNs.load(memory_order_relaxed));
+    }
+    snapshot.nodes += registry.others().nodes.load(memory_order_relaxed);
+    snapshot.solutions += registry.others().solutions.load(memory_order_relaxed);
+    return snapshot;
+}
+
+void appendMetricHeader(string &text, const char *name, const char *type, const char *help)
+{
+    text += string("# HELP ") + name + " " + help + "\n";
+    text += string("# TYPE ") + name + " " + type + "\n";
+}
+
+void appendMetric(string &text, const char *name, const char *type, const char *help,
+                  double value)
+{
+    char line[128];
+    appendMetricHeader(text, name, type, help);
+    snprintf(line, sizeof(line), "%s %.17g\n", name, value);
+    text += line;
+}
+
+// Prometheus text exposition of the registry, plus the subtree cache when
+// there is one. Rates cover the time since `previous`, which is updated.
+string renderMetrics(const SubtreeCache *cache, MetricsSnapshot &previous)
+{
+    MetricsRegistry &registry = metrics();
+    MetricsSnapshot current = takeMetricsSnapshot();
+    double seconds = chrono::duration<double>(current.time - previous.time).count();
+    if (seconds <= 0)
+        seconds = 1;
+
+    long long bytesWritten = registry.others().bytesWritten.load(memory_order_relaxed);
+    for (int i = 0; i < registry.workerCount(); i++)
+        bytesWritten += registry.worker(i).bytesWritten.load(memory_order_relaxed);
+
+    string text;
+    appendMetric(text, "nqueens_nodes_total", "counter", "Search nodes visited.",
+                 double(current.nodes));
+    appendMetric(text, "nqueens_solutions_total", "counter", "Solutions found.",
+                 double(current.solutions));
+    appendMetric(text, "nqueens_output_bytes_total", "counter", "Solution output bytes written.",
+                 double(bytesWritten));
+    appendMetric(text, "nqueens_nodes_per_second", "gauge", "Nodes per second since the last export.",
+                 double(current.nodes - previous.nodes) / seconds);
+    appendMetric(text, "nqueens_solutions_per_second", "gauge",
+                 "Solutions per second since the last export.",
+                 double(current.solutions - previous.solutions) / seconds);
+    appendMetric(text, "nqueens_queue_depth", "gauge", "Tasks waiting on the worker pool.",
+                 double(registry.queuedTasks.load(memory_order_relaxed)));
+
+    char line[128];
+    appendMetricHeader(text, "nqueens_thread_tasks_total", "counter", "Pool tasks run per worker.");
+    for (int i = 0; i < registry.workerCount(); i++)
+    {
+        snprintf(line, sizeof(line), "nqueens_thread_tasks_total{thread=\"%d\"} %lld\n",
+                 i, registry.worker(i).tasks.load(memory_order_relaxed));
+        text += line;
+    }
+    appendMetricHeader(text, "nqueens_thread_utilization", "gauge",
+                       "Share of time spent running pool tasks since the last export.");
+    for (int i = 0; i < int(current.busyNs.size()); i++)
+    {
+        long long before = i < int(previous.busyNs.size()) ? previous.busyNs[i] : 0;
+        snprintf(line, sizeof(line), "nqueens_thread_utilization{thread=\"%d\"} %.4f\n",
+                 i, min(1.0, double(current.busyNs[i] - before) / 1e9 / seconds));
+        text += line;
+    }
+
+    if (cache)
+    {
+        CacheStats stats = cache->stats();
+        appendMetric(text, "nqueens_cache_entries", "gauge", "Subtree cache entries.",
+                     double(stats.entries));
+        appendMetric(text, "nqueens_cache_lookups_total", "counter", "Subtree cache lookups.",
+                     double(stats.lookups));
+        appendMetric(text, "nqueens_cache_hits_total", "counter", "Subtree cache hits.",
+                     double(stats.hits));
+        appendMetric(text, "nqueens_cache_warm_hits_total", "counter",
+                     "Subtree cache hits answered from the warm snapshot.",
+                     double(stats.warmHits));
+        appendMetric(text, "nqueens_cache_hit_ratio", "gauge", "Subtree cache hits per lookup.",
+                     stats.lookups ? double(stats.hits) / double(stats.lookups) : 0.0);
+    }
+
+    previous = move(current);
+    return text;
+}
+
+// Publishes the metrics in the background: a Prometheus textfile rewritten
+// every interval (and once more on stop), and/or a plain HTTP endpoint on
+// localhost. Exporting only reads the counters.
+class MetricsExporter
+{
+public:
+    explicit MetricsExporter(const SubtreeCache *cache = nullptr) : cache(cache) {}
+
+    ~MetricsExporter() { stop(); }
+
+    void startTextfile(const string &path, chrono::milliseconds interval)
+    {
+        textfilePath = path;
+        textfilePrevious = takeMetricsSnapshot();
+        textfileThread = thread([this, interval]
+                                {
+                                    unique_lock<mutex> lock(stopMutex);
+                                    while (!stopSignal.wait_for(lock, interval, [this] { return stopping; }))
+                                        writeTextfile();
+                                });
+    }
 
-// If N is large, do not enumerate all solutions
-const int ENUMERATION_LIMIT = 21;
+    bool startHttp(int port, string &error)
+    {
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        int reuse = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(uint16_t(port));
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (listener < 0 ||
+            ::bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+            listen(listener, 16) != 0)
+        {
+            error = "cannot listen on port " + to_string(port);
+            return false;
+        }
 
-/* ---------------- GLOBAL STATE ---------------- */
+        httpPrevious = takeMetricsSnapshot();
+        httpThread = thread([this] { serveHttp(); });
+        return true;
+    }
 
-int boardSize;                  // Size of the board (N)
-uint64_t fullMask;              // Mask with N lowest bits set
-long long totalSolutions = 0;   // Count of solutions found
-bool terminateSearch = false;   // Stops recursion when limit reached
+    void stop()
+    {
+        {
+            lock_guard<mutex> lock(stopMutex);
+            if (stopping)
+                return;
+            stopping = true;
+        }
+        stopSignal.notify_all();
 
-FILE *solutionTempFile;         // Temporary file for solution storage
+        if (textfileThread.joinable())
+        {
+            textfileThread.join();
+            writeTextfile();
+        }
+        if (httpThread.joinable())
+            httpThread.join();
+        if (listener >= 0)
+            close(listener);
+    }
 
-/* ---------------- BUFFERED OUTPUT ---------------- */
+private:
+    // Written beside the target and renamed, so collectors never read half a file
+    void writeTextfile()
+    {
+        string temporary = textfilePath + ".tmp";
+        {
+            ofstream out(temporary, ios::binary);
+            out << renderMetrics(cache, textfilePrevious);
+        }
+        rename(temporary.c_str(), textfilePath.c_str());
+    }
+
+    void serveHttp()
+    {
+        pollfd waiting = {listener, POLLIN, 0};
+        while (true)
+        {
+            {
+                lock_guard<mutex> lock(stopMutex);
+                if (stopping)
+                    return;
+            }
+            if (poll(&waiting, 1, 200) <= 0)
+                continue;
+
+            int client = accept(listener, nullptr, nullptr);
+            if (client < 0)
+                continue;
+
+            char request[1024];
+            ssize_t received = recv(client, request, sizeof(request) - 1, 0);
+            request[max<ssize_t>(received, 0)] = '\0';
+
+            string body, status = "200 OK";
+            if (strncmp(request, "GET /metrics", 12) == 0)
+                body = renderMetrics(cache, httpPrevious);
+            else
+                status = "404 Not Found";
+
+            string response = "HTTP/1.1 " + status + "\r\n"
+                              "Content-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: " + to_string(body.size()) + "\r\n"
+                              "Connection: close\r\n\r\n" + body;
+            send(client, response.data(), response.size(), MSG_NOSIGNAL);
+            close(client);
+        }
+    }
+
+    const SubtreeCache *cache;
+
+    string textfilePath;
+    MetricsSnapshot textfilePrevious;
+    thread textfileThread;
+
+    int listener = -1;
+    MetricsSnapshot httpPrevious;
+    thread httpThread;
+
+    mutex stopMutex;
+    condition_variable stopSignal;
+    bool stopping = false;
+};
+
+/* ---------------- COMMAND LINE ---------------- */
+
+const char *USAGE =
+    "Usage: ./nqueens_solver <input_file> [options]\n"
+    "       ./nqueens_solver --validate <output_file>\n"
+    "       ./nqueens_solver --compare <output_file> <output_file>\n"
+    "       ./nqueens_solver --seek=K <output_file>\n"
+    "       ./nqueens_solver <instances_file> --batch [--limit=L]\n"
+    "       ./nqueens_solver <instances_file> --portfolio [--seed=S]\n"
+    "       ./nqueens_solver --serve [--cache-entries=E] [--snapshot=PATH]\n"
+    "       ./nqueens_solver <mix_file> --load-test [--rate=R] [--duration=S]\n"
+    "       ./nqueens_solver <weights_file> --max-weight [--time-limit=S]\n"
+    "  --symmetric=90|180   only solutions invariant under that rotation\n"
+    "  --unique             count unique solutions (Burnside), no output file\n"
+    "  --first=K            only the first K solutions in canonical order\n"
+    "  --format=FORMAT      text (default), csv, jsonl or binary\n"
+    "  --fingerprint        report the order-independent output fingerprint\n"
+    "  --no-three-in-line   only solutions with no three queens on any line\n"
+    "  --direct-write       count first, then write every solution in place\n"
+    "  --seek=K             print solution K of an output file\n"
+    "  --explain            show the execution plan and why, without solving\n"
+    "  --plugin=PATH        hand the solutions to a plugin instead of a file\n"
+    "  --plugin-args=ARGS   string passed to the plugin\n"
+    "  --generate-puzzles=COUNT  unique-completion puzzles to <input>_puzzles.txt\n"
+    "  --seed=S             random seed for the puzzle generator (default 1)\n"
+    "  --batch              solve one completion instance per line of the input\n"
+    "                       (N c1 .. cN [; r,c ..]) into <input>_results.txt\n"
+    "  --limit=L            stop counting completions at L\n"
+    "  --portfolio          one completion per instance, racing several\n"
+    "                       strategies, into <input>_portfolio.txt\n"
+    "  --serve              answer requests from stdin, one per line\n"
+    "                       (count N | complete .. | stats | snapshot | quit)\n"
+    "  --cache-entries=E    subtree cache size in server mode, 0 disables it\n"
+    "  --snapshot=PATH      server warm state: mapped at start if valid,\n"
+    "                       saved on quit and on a snapshot request\n"
+    "  --load-test          replay weighted server requests from the mix file\n"
+    "                       (W request per line) and report tail latency\n"
+    "  --rate=R             load test requests per second (default 100)\n"
+    "  --duration=S         load test seconds of sending (default 10)\n"
+    "  --max-weight         heaviest placement for the N x N weights after N\n"
+    "                       in the input, written to <input>_best.txt\n"
+    "  --time-limit=S       stop the max-weight search after S seconds; Ctrl-C\n"
+    "                       also stops it, and both keep the best placement found\n"
+    "  --metrics-file=PATH  write Prometheus metrics to PATH while running\n"
+    "  --metrics-interval=MS  time between two metrics file writes (default 5000)\n"
+    "  --metrics-port=P     serve metrics at http://127.0.0.1:P/metrics (server mode)\n";
 
-char outputBuffer[65536];
-int bufferIndex = 0;
+struct CommandLine
+{
+    vector<string> files;   // Positional arguments
+    int invariantRotation = 0;
+    bool uniqueCount = false;
+    long long firstSolutions = 0;
+    OutputFormat outputFormat = OutputFormat::Text;
+    bool fingerprint = false;
+    bool validate = false;
+    bool compare = false;
+    long long seekSolution = 0;
+    bool directWrite = false;
+    string pluginPath;
+    string pluginArgs;
+    bool explain = false;
+    long long puzzleCount = 0;
+    uint64_t seed = 1;
+    bool batch = false;
+    bool portfolio = false;
+    long long completionLimit = LLONG_MAX;
+    bool serve = false;
+    size_t cacheEntries = DEFAULT_CACHE_ENTRIES;
+    string snapshotFile;
+    bool loadTest = false;
+    double loadRate = DEFAULT_LOAD_RATE;
+    double loadSeconds = DEFAULT_LOAD_SECONDS;
+    bool maxWeight = false;
+    double timeLimit = 0;   // Seconds, 0 for none
+    bool noThreeInLine = false;
+    string metricsFile;
+    chrono::milliseconds metricsInterval = DEFAULT_METRICS_INTERVAL;
+    int metricsPort = 0;
+};
 
-void flushOutput()
+bool parseCommandLine(int argc, char *argv[], CommandLine &cmd)
 {
-    if (bufferIndex > 0)
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg.rfind("--", 0) != 0)
+            cmd.files.push_back(arg);
+        else if (arg == "--symmetric=90")
+            cmd.invariantRotation = 90;
+        else if (arg == "--symmetric=180")
+            cmd.invariantRotation = 180;
+        else if (arg == "--unique")
+            cmd.uniqueCount = true;
+        else if (arg == "--format=text")
+            cmd.outputFormat = OutputFormat::Text;
+        else if (arg == "--format=csv")
+            cmd.outputFormat = OutputFormat::Csv;
+        else if (arg == "--format=jsonl")
+            cmd.outputFormat = OutputFormat::JsonLines;
+        else if (arg == "--format=binary")
+            cmd.outputFormat = OutputFormat::Binary;
+        else if (arg == "--fingerprint")
+            cmd.fingerprint = true;
+        else if (arg == "--validate")
+            cmd.validate = true;
+        else if (arg == "--compare")
+            cmd.compare = true;
+        else if (arg == "--batch")
+            cmd.batch = true;
+        else if (arg == "--portfolio")
+            cmd.portfolio = true;
+        else if (arg == "--serve")
+            cmd.serve = true;
+        else if (arg == "--max-weight")
+            cmd.maxWeight = true;
+        else if (arg == "--load-test")
+            cmd.loadTest = true;
+        else if (arg == "--no-three-in-line")
+            cmd.noThreeInLine = true;
+        else if (arg == "--direct-write")
+            cmd.directWrite = true;
+        else if (arg == "--explain")
+            cmd.explain = true;
+        else if (arg.rfind("--plugin=", 0) == 0)
+            cmd.pluginPath = arg.substr(9);
+        else if (arg.rfind("--plugin-args=", 0) == 0)
+            cmd.pluginArgs = arg.substr(14);
+        else if (arg.rfind("--seek=", 0) == 0)
+        {
+            cmd.seekSolution = atoll(arg.c_str() + 7);
+            if (cmd.seekSolution <= 0)
+            {
+                cerr << "Invalid value: " << arg << "\n";
+                return false;
+            }
+        }
+        else if (arg.rfind("--cache-entries=", 0) == 0)
+            cmd.cacheEntries = size_t(strtoull(arg.c_str() + 16, nullptr, 10));
+        else if (arg.rfind("--rate=", 0) == 0)
+        {
+            cmd.loadRate = atof(arg.c_str() + 7);
+            if (!(cmd.loadRate > 0))
+            {
+                cerr << "Invalid value: " << arg << "\n";
+                return false;
+            }
+        }
+        else if (arg.rfind("--duration=", 0) == 0)
+        {
+            cmd.loadSeconds = atof(arg.c_str() + 11);
+            if (!(cmd.loadSeconds > 0))
+            {
+                cerr << "Invalid value: " << arg << "\n";
+                return false;
+            }
+        }
+        else if (arg.rfind("--time-limit=", 0) == 0)
+        {
+            cmd.timeLimit = atof(arg.c_str() + 13);
+            if (!(cmd.timeLimit > 0))
+            {
+                cerr << "Invalid value: " << arg << "\n";
+                return false;
+            }
+        }
+        else if (arg.rfind("--limit=", 0) == 0)
+        {
+            cmd.completionLimit = atoll(arg.c_str() + 8);
+            if (cmd.completionLimit <= 0)
+            {
+                cerr << "Invalid value: " << arg << "\n";
+                return false;
+            }
+        }
+        else if (arg.rfind("--seed=", 0) == 0)
+            cmd.seed = strtoull(arg.c_str() + 7, nullptr, 10);
+        else if (arg.rfind("--generate-puzzles=", 0) == 0)
+        {
+            cmd.puzzleCount = atoll(arg.c_str() + 19);
+            if (cmd.puzzleCount <= 0)
+            {
+                cerr << "Invalid value: " << arg << "\n";
+                return false;
+            }
+        }
+        else if (arg.rfind("--snapshot=", 0) == 0)
+            cmd.snapshotFile = arg.substr(11);
+        else if (arg.rfind("--metrics-file=", 0) == 0)
+            cmd.metricsFile = arg.substr(15);
+        else if (arg.rfind("--metrics-interval=", 0) == 0)
+        {
+            cmd.metricsInterval = chrono::milliseconds(atoll(arg.c_str() + 19));
+            if (cmd.metricsInterval.count() <= 0)
+            {
+                cerr << "Invalid value: " << arg << "\n";
+                return false;
+            }
+        }
+        else if (arg.rfind("--metrics-port=", 0) == 0)
+        {
+            cmd.metricsPort = atoi(arg.c_str() + 15);
+            if (cmd.metricsPort <= 0 || cmd.metricsPort > 65535)
+            {
+                cerr << "Invalid value: " << arg << "\n";
+                return false;
+            }
+        }
+        else if (arg.rfind("--first=", 0) == 0)
+        {
+            cmd.firstSolutions = atoll(arg.c_str() + 8);
+            if (cmd.firstSolutions <= 0)
+            {
+                cerr << "Invalid value: " << arg << "\n";
+                return false;
+            }
+        }
+        else
+        {
+            cerr << "Unknown option: " << arg << "\n";
+            return false;
+        }
+    }
+
+    if (cmd.noThreeInLine && (cmd.invariantRotation || cmd.firstSolutions || cmd.uniqueCount))
     {
-        fwrite(outputBuffer, 1, bufferIndex, solutionTempFile);
-        bufferIndex = 0;
+        cerr << "--no-three-in-line cannot be combined with --symmetric, --first or --unique\n";
+        return false;
     }
+    if (cmd.explain && (cmd.uniqueCount || cmd.puzzleCount))
+    {
+        cerr << "--explain cannot be combined with --unique or --generate-puzzles\n";
+        return false;
+    }
+    if (cmd.firstSolutions && (cmd.invariantRotation || cmd.uniqueCount))
+    {
+        cerr << "--first cannot be combined with --symmetric or --unique\n";
+        return false;
+    }
+    if (cmd.directWrite && !cmd.pluginPath.empty())
+    {
+        cerr << "--direct-write cannot be combined with --plugin, which writes no output file\n";
+        return false;
+    }
+    if ((cmd.directWrite || !cmd.pluginPath.empty()) && cmd.firstSolutions)
+    {
+        cerr << "--direct-write and --plugin cannot be combined with --first\n";
+        return false;
+    }
+    if (cmd.timeLimit > 0 && !cmd.maxWeight)
+    {
+        cerr << "--time-limit is only available with --max-weight\n";
+        return false;
+    }
+    if (cmd.metricsPort && !cmd.serve)
+    {
+        cerr << "--metrics-port is only available with --serve\n";
+        return false;
+    }
+    if (!cmd.snapshotFile.empty() && !cmd.serve && !cmd.loadTest)
+    {
+        cerr << "--snapshot is only available with --serve and --load-test\n";
+        return false;
+    }
+
+    return cmd.files.size() == (cmd.compare ? 2u : cmd.serve ? 0u : 1u);
 }
 
-inline void writeNumber(int value)
+/* ---------------- MODES ---------------- */
+
+long long millisecondsSince(chrono::high_resolution_clock::time_point startTime)
 {
-    char temp[16];
-    int length = 0;
+    return chrono::duration_cast<chrono::milliseconds>(
+               chrono::high_resolution_clock::now() - startTime).count();
+}
 
-    do
+int runValidateMode(const CommandLine &cmd)
+{
+    SolutionFileHeader header;
+    Fingerprint fingerprint;
+    string error;
+    if (!checkSolutionFile(cmd.files[0], header, fingerprint, error))
     {
-        temp[length++] = char('0' + (value % 10));
-        value /= 10;
-    } while (value);
-
-    if (bufferIndex + length + 1 >= 65536)
-        flushOutput();
+        cout << "Invalid: " << error << "\n";
+        return 1;
+    }
 
-    while (length--)
-        outputBuffer[bufferIndex++] = temp[length];
+    cout << "N = " << header.boardSize << "\n";
+    cout << "Solutions = " << fingerprint.solutions << "\n";
+    cout << "Fingerprint = " << formatFingerprint(fingerprint) << "\n";
+    cout << "Valid\n";
+    return 0;
 }
 
-inline void writeSpace()
+// Same multiset of solutions, whatever the order or format
+int runCompareMode(const CommandLine &cmd)
 {
-    if (bufferIndex >= 65536)
-        flushOutput();
-    outputBuffer[bufferIndex++] = ' ';
+    Fingerprint fingerprints[2];
+    for (int i = 0; i < 2; i++)
+    {
+        SolutionFileHeader header;
+        string error;
+        if (!checkSolutionFile(cmd.files[i], header, fingerprints[i], error))
+        {
+            cout << "Invalid: " << error << "\n";
+            return 1;
+        }
+        cout << cmd.files[i] << ": " << formatFingerprint(fingerprints[i]) << "\n";
+    }
+
+    bool same = fingerprints[0].solutions == fingerprints[1].solutions &&
+                fingerprints[0].hashSum == fingerprints[1].hashSum;
+    cout << (same ? "Match\n" : "Mismatch\n");
+    return same ? 0 : 1;
 }
 
-inline void writeLineBreak()
+// Every record of a file has the length of the first, so solution K is
+// read at a computed offset without scanning the ones before it
+int runSeekMode(const CommandLine &cmd)
 {
-    if (bufferIndex >= 65536)
-        flushOutput();
-    outputBuffer[bufferIndex++] = '\n';
+    ifstream in(cmd.files[0], ios::binary);
+    SolutionFileHeader header;
+    if (!in || !readSolutionHeader(in, header) || header.noSolution)
+    {
+        cout << "Invalid: unreadable header\n";
+        return 1;
+    }
+    if (header.solutions >= 0 && cmd.seekSolution > header.solutions)
+    {
+        cout << "Invalid: the file has " << header.solutions << " solutions\n";
+        return 1;
+    }
+
+    long long dataStart = (long long)in.tellg();
+    vector<int> placement;
+    if (!readRecord(in, header.format, header.boardSize, placement))
+    {
+        cout << "Invalid: the file has no solutions\n";
+        return 1;
+    }
+    long long recordSize = (long long)in.tellg() - dataStart;
+
+    in.seekg(dataStart + (cmd.seekSolution - 1) * recordSize);
+    if (!readRecord(in, header.format, header.boardSize, placement) ||
+        !isValidSolution(placement, header.boardSize))
+    {
+        cout << "Invalid: no solution " << cmd.seekSolution << "\n";
+        return 1;
+    }
+
+    for (int row = 0; row < header.boardSize; row++)
+        cout << placement[row] << (row + 1 < header.boardSize ? " " : "\n");
+    return 0;
 }
 
-/* ---------------- SOLUTION OUTPUT ---------------- */
+// Reports on stderr whether the server starts warm or cold
+void startFromSnapshot(ServerContext &server, const string &path)
+{
+    string error;
+    if (loadWarmState(server, path, error))
+        cerr << "Warm start: " << server.snapshot.countSize() << " counts, "
+             << server.snapshot.subtreeSize() << " subtrees mapped from " << path << "\n";
+    else
+        cerr << "Cold start: " << error << "\n";
+}
 
-void writeSolution(const vector<int> &placement)
+// Responses carry the number of the request line they answer, since
+// requests run concurrently and finish in any order
+int runServeMode(const CommandLine &cmd)
 {
-    for (int i = 0; i < boardSize; i++)
+    ServerContext server(cmd.cacheEntries);
+    if (!cmd.snapshotFile.empty())
+        startFromSnapshot(server, cmd.snapshotFile);
+
+    MetricsExporter exporter(&server.cache);
+    if (!cmd.metricsFile.empty())
+        exporter.startTextfile(cmd.metricsFile, cmd.metricsInterval);
+    string error;
+    if (cmd.metricsPort && !exporter.startHttp(cmd.metricsPort, error))
+    {
+        cerr << error << "\n";
+        return 1;
+    }
+
+    mutex outputMutex;
+    condition_variable idle;
+    long long pending = 0;
+
+    string line;
+    for (long long requestNumber = 1; getline(cin, line) && line != "quit"; requestNumber++)
+    {
+        {
+            lock_guard<mutex> lock(outputMutex);
+            pending++;
+        }
+
+        handleServerRequest(server, line, [&, requestNumber](const string &response)
+                            {
+                                lock_guard<mutex> lock(outputMutex);
+                                cout << requestNumber << " " << response << "\n" << flush;
+                                if (--pending == 0)
+                                    idle.notify_all();
+                            });
+    }
+
+    {
+        unique_lock<mutex> lock(outputMutex);
+        idle.wait(lock, [&] { return pending == 0; });
+    }
+
+    if (!cmd.snapshotFile.empty())
     {
-        writeNumber(placement[i]);
-        if (i < boardSize - 1)
-            writeSpace();
+        SnapshotTotals totals;
+        if (!saveWarmState(server, totals, error))
+        {
+            cerr << error << "\n";
+            return 1;
+        }
+        cerr << "Snapshot: " << totals.counts << " counts, " << totals.subtrees
+             << " subtrees saved to " << cmd.snapshotFile << "\n";
     }
-    writeLineBreak();
+    return 0;
 }
 
-void writeMirroredSolution(const vector<int> &placement)
+// Drives a fresh in-process server, so the numbers cover the request
+// handling and the solving but not a transport
+int runLoadTestMode(const CommandLine &cmd)
 {
-    for (int i = 0; i < boardSize; i++)
+    vector<LoadRequest> mix;
+    string error;
+    if (!readLoadMix(cmd.files[0], mix, error))
     {
-        writeNumber((boardSize + 1) - placement[i]);
-        if (i < boardSize - 1)
-            writeSpace();
+        cerr << error << "\n";
+        return 1;
     }
-    writeLineBreak();
+
+    ServerContext server(cmd.cacheEntries);
+    if (!cmd.snapshotFile.empty())
+        startFromSnapshot(server, cmd.snapshotFile);
+    LoadReport report = runLoad(server, mix, cmd.loadRate, cmd.loadSeconds, cmd.seed);
+
+    cout << "Requests = " << report.sent << " (" << report.errors << " errors)\n";
+    cout << "Throughput = " << (report.seconds > 0 ? double(report.sent) / report.seconds : 0.0)
+         << " requests/s (target " << cmd.loadRate << ")\n";
+    cout << "Latency = " << formatLatency(report.overall) << "\n";
+    for (const auto &entry : report.byCommand)
+        cout << "  " << entry.first << " (" << entry.second.count() << "): "
+             << formatLatency(entry.second) << "\n";
+    return 0;
 }
 
-/* ---------------- BACKTRACKING SOLVER ---------------- */
+// Cancelled by the first Ctrl-C of a max-weight run; a second one kills
+CancellationToken maxWeightInterrupt;
 
-void backtrack(uint64_t columns, uint64_t diagLeft, uint64_t diagRight,
-               vector<int> &placement)
+extern "C" void interruptMaxWeight(int)
 {
-    if (terminateSearch)
-        return;
+    maxWeightInterrupt.cancel();
+}
 
-    // All columns occupied -> valid solution
-    if (columns == fullMask)
+// Writes the best placement found even when stopped by --time-limit or
+// Ctrl-C, together with the bound still open at that point
+int runMaxWeightMode(const CommandLine &cmd, chrono::high_resolution_clock::time_point startTime)
+{
+    const string &inputFile = cmd.files[0];
+    WeightedBoard board;
+    if (!readWeightedBoard(inputFile, board))
     {
-        totalSolutions++;
-        writeSolution(placement);
+        cerr << "Invalid weights file\n";
+        return 1;
+    }
 
-        
-        return;
+    const CancellationToken &cancelToken = maxWeightInterrupt;
+    struct sigaction action = {};
+    action.sa_handler = interruptMaxWeight;
+    action.sa_flags = SA_RESETHAND;
+    sigaction(SIGINT, &action, nullptr);
+
+    mutex timerMutex;
+    condition_variable timerSignal;
+    bool searchDone = false;
+    thread timer;
+    if (cmd.timeLimit > 0)
+        timer = thread([&]
+                       {
+                           unique_lock<mutex> lock(timerMutex);
+                           if (!timerSignal.wait_for(lock, chrono::duration<double>(cmd.timeLimit),
+                                                     [&] { return searchDone; }))
+                               cancelToken.cancel();
+                       });
+
+    WeightResult result = maximizeWeight(board, cancelToken, [](const WeightProgress &progress)
+                                         {
+                                             if (progress.incumbent == LLONG_MIN)
+                                                 cout << "Incumbent = none";
+                                             else
+                                                 cout << "Incumbent = " << progress.incumbent;
+                                             cout << ", Bound = " << progress.upperBound
+                                                  << ", Gap = " << 100.0 * progress.gap << "%"
+                                                  << ", Nodes = " << progress.nodes << "\n" << flush;
+                                         });
+
+    {
+        lock_guard<mutex> lock(timerMutex);
+        searchDone = true;
     }
+    timerSignal.notify_all();
+    if (timer.joinable())
+        timer.join();
+    signal(SIGINT, SIG_DFL);
 
-    // Calculate available positions
-    uint64_t available =
-        ~(columns | diagLeft | diagRight) & fullMask;
+    if (!result.optimal)
+        cout << "Stopped before the proof, Bound = " << result.upperBound << "\n";
 
-    while (available)
+    string bestFile = inputFile.substr(0, inputFile.find_last_of('.')) + "_best.txt";
+    if (result.placement.empty())
     {
-        if (terminateSearch)
-            return;
+        if (!result.optimal)
+        {
+            cout << "No placement found\n";
+            return 0;
+        }
+        ofstream out(bestFile);
+        out << "No Solution";
+        cout << "No Solution\n";
+        return 0;
+    }
 
-        // Select the lowest available column
-        uint64_t bit = available & -available;
-        available -= bit;
+    ofstream out(bestFile);
+    out << board.boardSize << "\n" << result.bestWeight << "\n";
+    for (int i = 0; i < board.boardSize; i++)
+        out << result.placement[i] << (i < board.boardSize - 1 ? " " : "\n");
 
-        int colIndex = __builtin_ctzll(bit);
+    cout << "N = " << board.boardSize << "\n";
+    cout << "Weight = " << result.bestWeight << "\n";
+    cout << "Nodes = " << result.nodes << "\n";
+    cout << "Time = " << millisecondsSince(startTime) << " ms\n";
+    return 0;
+}
 
-        placement.push_back(colIndex + 1);
+// One result line per instance: the completion count, then the first
+// completion if there is one
+int runBatchMode(const CommandLine &cmd, chrono::high_resolution_clock::time_point startTime)
+{
+    const string &inputFile = cmd.files[0];
+    ifstream input(inputFile);
+    if (!input)
+    {
+        cerr << "Invalid input file\n";
+        return 1;
+    }
 
-        backtrack(columns | bit,
-                  (diagLeft | bit) << 1,
-                  (diagRight | bit) >> 1,
-                  placement);
+    vector<CompletionInstance> instances;
+    string line;
+    for (int lineNumber = 1; getline(input, line); lineNumber++)
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
 
-        placement.pop_back(); // undo placement
+        instances.emplace_back();
+        if (!parseCompletionInstance(line, instances.back()))
+        {
+            cerr << "Invalid instance on line " << lineNumber << "\n";
+            return 1;
+        }
     }
-}
 
-/* ---------------- SYMMETRY OPTIMIZED SOLVER ---------------- */
+    auto solveStart = chrono::high_resolution_clock::now();
+    vector<CompletionResult> results = solveCompletionBatch(instances, cmd.completionLimit);
+    double seconds = chrono::duration<double>(
+                         chrono::high_resolution_clock::now() - solveStart).count();
+
+    string resultFile = inputFile.substr(0, inputFile.find_last_of('.')) + "_results.txt";
+    ofstream out(resultFile);
+    for (const CompletionResult &result : results)
+    {
+        out << result.solutions;
+        for (int col : result.firstCompletion)
+            out << " " << col;
+        out << "\n";
+    }
 
-void solveWithSymmetry()
+    cout << "Instances = " << instances.size() << "\n";
+    cout << "Throughput = " << (seconds > 0 ? double(instances.size()) / seconds : 0.0)
+         << " instances/s\n";
+    cout << "Time = " << millisecondsSince(startTime) << " ms\n";
+    return 0;
+}
+
+// Reports the winning strategy per instance and how often each one won
+int runPortfolioMode(const CommandLine &cmd, chrono::high_resolution_clock::time_point startTime)
 {
-    // For large N, skip symmetry optimization
-    if (boardSize >= ENUMERATION_LIMIT)
+    const string &inputFile = cmd.files[0];
+    ifstream input(inputFile);
+    if (!input)
     {
-        vector<int> placement;
-        backtrack(0, 0, 0, placement);
-        return;
+        cerr << "Invalid input file\n";
+        return 1;
     }
 
-    vector<int> placement;
-    int halfColumns = boardSize / 2;
+    string resultFile = inputFile.substr(0, inputFile.find_last_of('.')) + "_portfolio.txt";
+    ofstream out(resultFile);
+    map<string, long long> wins;
+    long long instanceCount = 0;
 
-    // Explore only half the first row (mirrors cover the rest)
-    for (int col = 0; col < halfColumns; col++)
+    string line;
+    for (int lineNumber = 1; getline(input, line); lineNumber++)
     {
-        uint64_t bit = 1ULL << col;
-        placement.push_back(col + 1);
+        if (line.empty() || line[0] == '#')
+            continue;
 
-        auto symmetricDFS =
-            [&](auto &&self, uint64_t c, uint64_t l, uint64_t r) -> void
+        CompletionInstance instance;
+        if (!parseCompletionInstance(line, instance))
         {
-            if (c == fullMask)
-            {
-                totalSolutions++;
-                writeSolution(placement);
+            cerr << "Invalid instance on line " << lineNumber << "\n";
+            return 1;
+        }
 
-                totalSolutions++;
-                writeMirroredSolution(placement);
-                return;
-            }
+        PortfolioResult result = solvePortfolio(instance, cmd.seed + instanceCount++);
+        wins[result.strategy]++;
+        out << result.strategy;
+        if (result.completion.empty())
+            out << " none";
+        for (int col : result.completion)
+            out << " " << col;
+        out << "\n";
+    }
 
-            uint64_t possible = ~(c | l | r) & fullMask;
-            while (possible)
-            {
-                uint64_t b = possible & -possible;
-                possible -= b;
+    cout << "Instances = " << instanceCount << "\n";
+    for (const auto &strategy : wins)
+        cout << "Wins " << strategy.first << " = " << strategy.second << "\n";
+    cout << "Time = " << millisecondsSince(startTime) << " ms\n";
+    return 0;
+}
 
-                placement.push_back(__builtin_ctzll(b) + 1);
-                self(self, c | b, (l | b) << 1, (r | b) >> 1);
-                placement.pop_back();
-            }
-        };
+int runUniqueMode(int boardSize, chrono::high_resolution_clock::time_point startTime)
+{
+    UniqueCount count = countUniqueSolutions(boardSize);
 
-        symmetricDFS(symmetricDFS, bit, bit << 1, bit >> 1);
-        placement.pop_back();
+    cout << "N = " << boardSize << "\n";
+    cout << "Solutions = " << count.totalSolutions << "\n";
+    cout << "Fixed by 90 = " << count.fixedBy90 << "\n";
+    cout << "Fixed by 180 = " << count.fixedBy180 << "\n";
+    cout << "Unique = " << count.uniqueSolutions << "\n";
+    cout << "Time = " << millisecondsSince(startTime) << " ms\n";
+    return 0;
+}
+
+// Puzzles are written like solutions, with 0 for an empty row
+int runPuzzleMode(const CommandLine &cmd, int boardSize,
+                  chrono::high_resolution_clock::time_point startTime)
+{
+    const string &inputFile = cmd.files[0];
+    string puzzleFile = inputFile.substr(0, inputFile.find_last_of('.')) + "_puzzles.txt";
+
+    auto generateStart = chrono::high_resolution_clock::now();
+    vector<vector<int>> puzzles = generatePuzzles(boardSize, size_t(cmd.puzzleCount), cmd.seed);
+    double seconds = chrono::duration<double>(
+                         chrono::high_resolution_clock::now() - generateStart).count();
+
+    ofstream out(puzzleFile);
+    out << boardSize << "\n" << puzzles.size() << "\n";
+
+    long long clues = 0;
+    for (const vector<int> &puzzle : puzzles)
+    {
+        for (int i = 0; i < boardSize; i++)
+        {
+            out << puzzle[i] << (i < boardSize - 1 ? " " : "\n");
+            clues += puzzle[i] != 0;
+        }
     }
 
-    // Handle middle column separately for odd N
-    if (boardSize % 2 == 1)
+    cout << "N = " << boardSize << "\n";
+    cout << "Puzzles = " << puzzles.size() << "\n";
+    cout << "Average clues = " << double(clues) / double(puzzles.size()) << "\n";
+    cout << "Throughput = " << (seconds > 0 ? double(puzzles.size()) / seconds : 0.0)
+         << " puzzles/s\n";
+    cout << "Time = " << millisecondsSince(startTime) << " ms\n";
+    return 0;
+}
+
+PlanRequest planRequestFor(const CommandLine &cmd, int boardSize)
+{
+    PlanRequest request;
+    request.boardSize = boardSize;
+    request.mode = cmd.firstSolutions ? PlanMode::First : PlanMode::Enumerate;
+    request.firstSolutions = cmd.firstSolutions;
+    request.invariantRotation = cmd.invariantRotation;
+    request.noThreeInLine = cmd.noThreeInLine;
+    request.outputFormat = cmd.outputFormat;
+    request.plugin = !cmd.pluginPath.empty();
+    request.forceDirectWrite = cmd.directWrite;
+    return request;
+}
+
+int runExplainMode(const CommandLine &cmd, int boardSize)
+{
+    cout << "N = " << boardSize << "\n";
+    cout << explainPlan(planExecution(planRequestFor(cmd, boardSize)));
+    return 0;
+}
+
+int runSolveMode(const CommandLine &cmd, int boardSize, const string &outputFile,
+                 chrono::high_resolution_clock::time_point startTime)
+{
+    ExecutionPlan plan = planExecution(planRequestFor(cmd, boardSize));
+    if (plan.estimatedSeconds >= PLAN_LOG_SECONDS)
+        cerr << "Plan: " << summarizePlan(plan) << "\n";
+
+    SolveOptions options;
+    options.boardSize = boardSize;
+    options.outputFile = outputFile;
+    options.invariantRotation = cmd.invariantRotation;
+    options.noThreeInLine = cmd.noThreeInLine;
+    options.firstSolutions = cmd.firstSolutions;
+    options.outputFormat = cmd.outputFormat;
+    options.fingerprint = cmd.fingerprint;
+    options.directWrite = plan.directWrite;
+    options.splitDepth = plan.splitDepth;
+    options.mirrorHalving = plan.mirrorHalving;
+
+    if (!cmd.pluginPath.empty())
     {
-        int mid = boardSize / 2;
-        uint64_t bit = 1ULL << mid;
-        placement.push_back(mid + 1);
-        backtrack(bit, bit << 1, bit >> 1, placement);
-        placement.pop_back();
+        auto plugin = make_shared<Plugin>();
+        string error;
+        if (!loadPlugin(cmd.pluginPath, *plugin, error))
+        {
+            cerr << error << "\n";
+            return 1;
+        }
+        plugin->args = cmd.pluginArgs;
+        attachPlugin(options, plugin);
+    }
+
+    SolveResult result = submitJob(options).get();
+    if (!result.error.empty())
+    {
+        cerr << result.error << "\n";
+        return 1;
     }
+    if (result.visitor)
+        static_cast<PluginVisitor &>(*result.visitor).finish(result.totalSolutions);
+
+    cout << "N = " << boardSize << "\n";
+    cout << "Solutions = " << result.totalSolutions << "\n";
+    if (cmd.fingerprint)
+        cout << "Fingerprint = " << formatFingerprint(result.fingerprint) << "\n";
+    cout << "Time = " << millisecondsSince(startTime) << " ms\n";
+    return 0;
 }
 
 /* ---------------- MAIN ---------------- */
@@ -204,21 +5488,57 @@ int main(int argc, char *argv[])
 {
     auto startTime = chrono::high_resolution_clock::now();
 
-    if (argc < 2)
+    CommandLine cmd;
+    if (!parseCommandLine(argc, argv, cmd))
     {
-        cerr << "Usage: ./nqueens_solver <input_file>\n";
+        cerr << USAGE;
         return 1;
     }
 
-    ifstream input(argv[1]);
+    if (cmd.validate)
+        return runValidateMode(cmd);
+    if (cmd.compare)
+        return runCompareMode(cmd);
+    if (cmd.seekSolution > 0)
+        return runSeekMode(cmd);
+    if (cmd.serve)
+        return runServeMode(cmd);
+    if (cmd.loadTest)
+        return runLoadTestMode(cmd);
+
+    // Every other mode may run long enough to be worth watching
+    MetricsExporter exporter;
+    if (!cmd.metricsFile.empty())
+        exporter.startTextfile(cmd.metricsFile, cmd.metricsInterval);
+
+    if (cmd.batch)
+        return runBatchMode(cmd, startTime);
+    if (cmd.portfolio)
+        return runPortfolioMode(cmd, startTime);
+    if (cmd.maxWeight)
+        return runMaxWeightMode(cmd, startTime);
+
+    const string &inputFile = cmd.files[0];
+    int boardSize;
+    ifstream input(inputFile);
     if (!input || !(input >> boardSize))
     {
         cerr << "Invalid input file\n";
         return 1;
     }
+    if (boardSize < 1 || boardSize > MAX_BOARD_SIZE)
+    {
+        cerr << "N must be between 1 and " << MAX_BOARD_SIZE << "\n" << USAGE;
+        return 1;
+    }
 
     string outputFile =
-        string(argv[1]).substr(0, string(argv[1]).find_last_of('.')) + "_output.txt";
+        inputFile.substr(0, inputFile.find_last_of('.')) + "_output" +
+        withOutputFormat(cmd.outputFormat, [](auto policy)
+                         { return string(decltype(policy)::extension()); });
+
+    if (cmd.explain)
+        return runExplainMode(cmd, boardSize);
 
     // No solution cases
     if (boardSize == 2 || boardSize == 3)
@@ -229,37 +5549,10 @@ int main(int argc, char *argv[])
         return 0;
     }
 
-    fullMask = (1ULL << boardSize) - 1;
-
-    solutionTempFile = tmpfile();
-    if (!solutionTempFile)
-    {
-        cerr << "Failed to create temp file\n";
-        return 1;
-    }
-
-    solveWithSymmetry();
-    flushOutput();
-
-    ofstream out(outputFile);
-    out << boardSize << "\n";
-    out << totalSolutions << "\n";
+    if (cmd.uniqueCount)
+        return runUniqueMode(boardSize, startTime);
+    if (cmd.puzzleCount > 0)
+        return runPuzzleMode(cmd, boardSize, startTime);
 
-    rewind(solutionTempFile);
-    char copyBuffer[4096];
-    size_t bytesRead;
-    while ((bytesRead = fread(copyBuffer, 1, sizeof(copyBuffer), solutionTempFile)) > 0)
-        out.write(copyBuffer, bytesRead);
-
-    fclose(solutionTempFile);
-
-    auto endTime = chrono::high_resolution_clock::now();
-
-    cout << "N = " << boardSize << "\n";
-    cout << "Solutions = " << totalSolutions << "\n";
-    cout << "Time = "
-         << chrono::duration_cast<chrono::milliseconds>(endTime - startTime).count()
-         << " ms\n";
-
-    return 0;
-}
\ No newline at end of file
+    return runSolveMode(cmd, boardSize, outputFile, startTime);
+}